@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Synthetic client used by the compositor benchmark (main -B).
+// It maps a single xdg toplevel and commits a freshly painted shm buffer
+// at a fixed rate, without waiting for frame callbacks.
+
+struct buffer {
+        struct wl_buffer *buffer;
+        uint32_t *data;
+        bool busy; // Still held by the compositor
+};
+
+struct client {
+        struct wl_display *display;
+        struct wl_registry *registry;
+        struct wl_compositor *compositor;
+        struct wl_shm *shm;
+        struct xdg_wm_base *wm_base;
+
+        struct wl_surface *surface;
+        struct xdg_surface *xdg_surface;
+        struct xdg_toplevel *xdg_toplevel;
+
+        struct buffer buffers[2];
+        int width;
+        int height;
+        uint32_t frame;
+
+        bool configured;
+        bool running;
+};
+
+void handle_wm_base_ping(void *data, struct xdg_wm_base *wm_base, uint32_t serial)
+{
+        xdg_wm_base_pong(wm_base, serial);
+}
+
+const struct xdg_wm_base_listener wm_base_listener = {
+        .ping = handle_wm_base_ping,
+};
+
+void handle_registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+{
+        struct client *client = (struct client *)data;
+
+        if (strcmp(interface, wl_compositor_interface.name) == 0) {
+                client->compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+        } else if (strcmp(interface, wl_shm_interface.name) == 0) {
+                client->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+        } else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+                client->wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+                xdg_wm_base_add_listener(client->wm_base, &wm_base_listener, client);
+        }
+}
+
+void handle_registry_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+}
+
+const struct wl_registry_listener registry_listener = {
+        .global = handle_registry_global,
+        .global_remove = handle_registry_global_remove,
+};
+
+void handle_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
+{
+        struct client *client = (struct client *)data;
+
+        xdg_surface_ack_configure(xdg_surface, serial);
+        client->configured = true;
+}
+
+const struct xdg_surface_listener xdg_surface_listener = {
+        .configure = handle_xdg_surface_configure,
+};
+
+void handle_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height, struct wl_array *states)
+{
+        // The buffer size is fixed, it's what the benchmark asked for
+}
+
+void handle_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel)
+{
+        struct client *client = (struct client *)data;
+
+        client->running = false;
+}
+
+const struct xdg_toplevel_listener xdg_toplevel_listener = {
+        .configure = handle_xdg_toplevel_configure,
+        .close = handle_xdg_toplevel_close,
+};
+
+void handle_buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+        struct buffer *buffer = (struct buffer *)data;
+
+        buffer->busy = false;
+}
+
+const struct wl_buffer_listener buffer_listener = {
+        .release = handle_buffer_release,
+};
+
+bool create_buffers(struct client *client)
+{
+        int stride = client->width * 4;
+        size_t size = (size_t)stride * client->height;
+        struct wl_shm_pool *pool;
+        uint8_t *data;
+        int fd, i;
+
+        fd = memfd_create("bench-client", MFD_CLOEXEC);
+        if (fd < 0 || ftruncate(fd, size * 2) < 0) {
+                perror("Failed to create shm file");
+                return false;
+        }
+
+        data = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+                perror("Failed to map shm file");
+                close(fd);
+                return false;
+        }
+
+        pool = wl_shm_create_pool(client->shm, fd, size * 2);
+        for (i = 0; i < 2; ++i) {
+                client->buffers[i].buffer = wl_shm_pool_create_buffer(pool, size * i, client->width, client->height, stride, WL_SHM_FORMAT_XRGB8888);
+                client->buffers[i].data = (uint32_t *)(data + size * i);
+                wl_buffer_add_listener(client->buffers[i].buffer, &buffer_listener, &client->buffers[i]);
+        }
+        wl_shm_pool_destroy(pool);
+        close(fd);
+
+        return true;
+}
+
+void draw_and_commit(struct client *client)
+{
+        struct buffer *buffer = NULL;
+        uint32_t color;
+        int i;
+
+        for (i = 0; i < 2; ++i) {
+                if (!client->buffers[i].busy) {
+                        buffer = &client->buffers[i];
+                        break;
+                }
+        }
+
+        // The compositor holds both buffers, skip this frame
+        if (!buffer)
+                return;
+
+        color = 0xff000000 | (client->frame * 0x010305);
+        for (i = 0; i < client->width * client->height; ++i)
+                buffer->data[i] = color;
+
+        wl_surface_attach(client->surface, buffer->buffer, 0, 0);
+        wl_surface_damage_buffer(client->surface, 0, 0, client->width, client->height);
+        wl_surface_commit(client->surface);
+        buffer->busy = true;
+        ++client->frame;
+}
+
+int64_t now_ns(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+        struct client client = { 0 };
+        struct pollfd pollfd;
+        int64_t interval_ns, next_commit, now;
+        int rate = 60;
+        int opt, timeout;
+
+        client.width = 640;
+        client.height = 480;
+
+        while ((opt = getopt(argc, argv, "r:s:")) != -1) {
+                switch (opt) {
+                case 'r':
+                        rate = atoi(optarg);
+                        break;
+                case 's':
+                        if (sscanf(optarg, "%dx%d", &client.width, &client.height) != 2)
+                                return 1;
+                        break;
+                default:
+                        fprintf(stderr, "Usage: %s [-r RATE] [-s WIDTHxHEIGHT]\n", argv[0]);
+                        return 1;
+                }
+        }
+
+        if (rate <= 0 || client.width <= 0 || client.height <= 0)
+                return 1;
+
+        client.display = wl_display_connect(NULL);
+        if (!client.display) {
+                fprintf(stderr, "Failed to connect to the Wayland display\n");
+                return 1;
+        }
+
+        client.registry = wl_display_get_registry(client.display);
+        wl_registry_add_listener(client.registry, &registry_listener, &client);
+        wl_display_roundtrip(client.display);
+
+        if (!client.compositor || !client.shm || !client.wm_base) {
+                fprintf(stderr, "Missing required globals\n");
+                return 1;
+        }
+
+        if (!create_buffers(&client))
+                return 1;
+
+        client.surface = wl_compositor_create_surface(client.compositor);
+        client.xdg_surface = xdg_wm_base_get_xdg_surface(client.wm_base, client.surface);
+        xdg_surface_add_listener(client.xdg_surface, &xdg_surface_listener, &client);
+        client.xdg_toplevel = xdg_surface_get_toplevel(client.xdg_surface);
+        xdg_toplevel_add_listener(client.xdg_toplevel, &xdg_toplevel_listener, &client);
+        xdg_toplevel_set_title(client.xdg_toplevel, "bench-client");
+        xdg_toplevel_set_app_id(client.xdg_toplevel, "bench-client");
+
+        // Initial commit without a buffer, the compositor replies with a configure
+        wl_surface_commit(client.surface);
+
+        interval_ns = 1000000000 / rate;
+        next_commit = now_ns();
+        client.running = true;
+
+        pollfd.fd = wl_display_get_fd(client.display);
+        pollfd.events = POLLIN;
+
+        while (client.running) {
+                now = now_ns();
+                if (client.configured && now >= next_commit) {
+                        draw_and_commit(&client);
+                        next_commit += interval_ns;
+                        if (next_commit < now)
+                                next_commit = now + interval_ns; // We fell behind, don't try to catch up
+                }
+
+                while (wl_display_prepare_read(client.display) != 0)
+                        wl_display_dispatch_pending(client.display);
+                if (wl_display_flush(client.display) < 0)
+                        break;
+
+                timeout = (int)((next_commit - now_ns()) / 1000000);
+                if (timeout < 0)
+                        timeout = 0;
+
+                if (poll(&pollfd, 1, client.configured ? timeout : -1) > 0 && (pollfd.revents & POLLIN)) {
+                        if (wl_display_read_events(client.display) < 0)
+                                break;
+                } else {
+                        wl_display_cancel_read(client.display);
+                }
+
+                if (wl_display_dispatch_pending(client.display) < 0)
+                        break;
+        }
+
+        wl_display_disconnect(client.display);
+
+        return 0;
+}
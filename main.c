@@ -1,20 +1,285 @@
 #include <wayland-server.h>
 #include <wlr/util/log.h>
+#include <wlr/util/box.h>
 #include <wlr/backend.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/render/allocator.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_subcompositor.h>
 #include <wlr/types/wlr_data_device.h>
+#include <wlr/types/wlr_primary_selection.h>
+#include <wlr/types/wlr_primary_selection_v1.h>
 #include <wlr/types/wlr_output_layout.h>
+#include <wlr/types/wlr_output_management_v1.h>
+#include <wlr/types/wlr_presentation_time.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
+#include <wlr/types/wlr_linux_dmabuf_v1.h>
+#include <wlr/types/wlr_linux_drm_syncobj_v1.h>
+#include <wlr/types/wlr_tearing_control_v1.h>
+#include <wlr/types/wlr_drm.h>
+#include <wlr/types/wlr_keyboard.h>
+#include <wlr/types/wlr_pointer.h>
+#include <wlr/interfaces/wlr_keyboard.h>
+#include <wlr/interfaces/wlr_pointer.h>
+#include <wlr/backend/headless.h>
+#include <wlr/render/pixman.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Number of events kept by the tracer, must be a power of two
+#define TRACE_RING_SIZE 65536
+
+// Modifiers that are taken into account when matching keybindings
+// (locks like caps lock and num lock are ignored)
+#define KEYBINDING_MODIFIERS (WLR_MODIFIER_SHIFT | WLR_MODIFIER_CTRL | WLR_MODIFIER_ALT | WLR_MODIFIER_LOGO)
+
+// Why a frame with a fullscreen toplevel couldn't be scanned out directly
+enum scanout_fallback {
+        SCANOUT_FALLBACK_NO_BUFFER, // The toplevel has no buffer attached
+        SCANOUT_FALLBACK_NOT_DMABUF, // Shared memory buffers can't go on a hardware plane
+        SCANOUT_FALLBACK_SIZE, // The buffer doesn't cover the whole output
+        SCANOUT_FALLBACK_COMPOSITED, // Other content was visible or the backend rejected the buffer
+        SCANOUT_FALLBACK_COUNT,
+};
+
+// Maximum number of keyboard events buffered before they're delivered to clients
+#define INPUT_QUEUE_SIZE 256
+
+// Highest evdev keycode (KEY_MAX)
+#define KEYCODE_MAX 0x2ff
+
+// Number of compiled keymaps kept around after their last keyboard is gone
+#define KEYMAP_CACHE_SIZE 8
+
+// Size (in layout pixels) of a spatial index grid cell and number of hash buckets
+// used to store the cells (must be a power of two)
+#define SPATIAL_CELL_SIZE 256
+#define SPATIAL_BUCKETS 1024
+
+// Safety margin kept between the end of a delayed render and the predicted vblank
+#define FRAME_DELAY_MARGIN_NS 1000000
+
+// How long a layout transaction waits for clients to commit their new size
+#define TRANSACTION_TIMEOUT_MS 200
+
+// Number of popup positions remembered (must be a power of two)
+#define POSITIONER_CACHE_SIZE 64
+
+// Everything the position of a popup depends on: its positioner rules and
+// the box it has to fit in (relative to its parent)
+struct positioner_key {
+        struct wlr_box anchor_rect;
+        uint32_t anchor;
+        uint32_t gravity;
+        uint32_t constraint_adjustment;
+        int32_t width, height;
+        int32_t offset_x, offset_y;
+        struct wlr_box constraint;
+};
+
+struct positioner_cache_entry {
+        bool valid;
+        struct positioner_key key;
+        struct wlr_box geometry; // Unconstrained popup geometry, relative to the parent
+};
+
+// Number of objects allocated at once when an object pool runs out
+#define POOL_SLAB_OBJECTS 64
+
+// Number of histogram buckets, bucket i counts values below 2^i microseconds
+// (the last one counts everything else)
+#define HISTOGRAM_BUCKETS 20
+
+// Maximum number of metrics socket connections served at once
+#define METRICS_MAX_CONNECTIONS 8
+
+// Bytes moved per wakeup of a clipboard transfer, a large transfer is spread
+// over many event loop iterations instead of stalling input and frames
+#define CLIPBOARD_CHUNK_SIZE (64 * 1024)
+
+// MIME types copied per cached selection
+#define CLIPBOARD_CACHE_TYPES 4
+
+// Number of workspaces, bound to keys as 1 to WORKSPACE_COUNT
+#define WORKSPACE_COUNT 10
+
+// Session snapshot file format (see session_save)
+#define SESSION_MAGIC 0x53534357 // "WCSS"
+#define SESSION_VERSION 1
+
+// Session entries not matched this long after startup are dropped, so
+// windows opened later on don't take a place from the previous session
+#define SESSION_GRACE_MS 60000
+
+// Maximum number of startup phases recorded (see startup_mark)
+#define STARTUP_PHASES 8
+
+struct histogram {
+        uint64_t buckets[HISTOGRAM_BUCKETS];
+        uint64_t count;
+        int64_t sum_ns;
+};
+
+// Event counter that also knows the number of events in the last second
+struct rate_counter {
+        uint64_t total;
+        uint32_t window_start_msec;
+        uint64_t window_count; // Events since window_start_msec
+        uint64_t rate; // Events in the previous window
+};
+
+// Object pool for the fixed-size structs that come and go with outputs,
+// keyboards and toplevels. Objects are carved out of slabs and recycled
+// through a free list, slabs are only released when the pool is finished.
+struct pool_free {
+        struct pool_free *next;
+};
+
+struct pool_slab {
+        struct pool_slab *next;
+        _Alignas(max_align_t) unsigned char objects[];
+};
+
+struct pool {
+        const char *name;
+        size_t object_size; // Rounded up so every object stays aligned
+        struct pool_slab *slabs;
+        struct pool_free *free_list;
+        size_t slabs_len;
+        size_t live; // Objects currently handed out
+        size_t high_water; // Highest number of live objects so far
+};
+
+// Spatial index over the bounding boxes of mapped toplevels (in layout coordinates).
+// The layout is split into a uniform grid, each cell knows which toplevels overlap it,
+// so finding the toplevel under the cursor only has to look at a single cell.
+struct spatial_cell {
+        int x, y; // Grid coordinates
+        struct toplevel_info **toplevels;
+        size_t len;
+        size_t capacity;
+        struct spatial_cell *next; // Next cell in the same hash bucket
+};
+
+struct spatial_index {
+        struct spatial_cell *buckets[SPATIAL_BUCKETS];
+};
+
+// What the cursor currently shows. wlr_cursor is only called when this changes,
+// since setting an image is not free (xcursor lookups, re-uploading the image).
+enum cursor_image_type {
+        CURSOR_IMAGE_NONE, // Nothing set yet
+        CURSOR_IMAGE_XCURSOR, // Image from the xcursor theme (compositor owned)
+        CURSOR_IMAGE_SURFACE, // Surface provided by a client
+        CURSOR_IMAGE_HIDDEN, // Hidden by a client
+};
+
+// How a layout container (one per output) places its toplevels
+enum layout_mode {
+        LAYOUT_TILING, // Master column on the left, the others stacked on the right
+        LAYOUT_FLOATING, // Toplevels keep their own size and position
+        LAYOUT_MONOCLE, // Every toplevel covers the whole output
+};
+
+enum keybinding_action {
+        KEYBINDING_QUIT,
+        KEYBINDING_CLOSE, // Ask the focused toplevel to close
+        KEYBINDING_FOCUS_NEXT,
+        KEYBINDING_FOCUS_PREV,
+        KEYBINDING_MOVE, // Move the focused toplevel by (dx, dy)
+        KEYBINDING_SPAWN, // Run a shell command
+        KEYBINDING_LAYOUT, // Change the layout of the focused output
+        KEYBINDING_TOGGLE_FLOATING, // Take the focused toplevel out of the layout, or put it back
+        KEYBINDING_WORKSPACE, // Show another workspace
+        KEYBINDING_MOVE_TO_WORKSPACE, // Send the focused toplevel to another workspace
+        KEYBINDING_RESTART, // Save the session and start again
+};
+
+struct keybinding {
+        uint32_t modifiers;
+        xkb_keysym_t keysym; // XKB_KEY_NoSymbol marks an empty slot
+        enum keybinding_action action;
+        char *command;
+        int dx, dy;
+        enum layout_mode layout;
+        int workspace; // Index in state->workspaces
+};
+
+// Open addressing hash table keyed by (modifiers, keysym), so looking up a
+// key press is a single probe sequence no matter how many bindings exist
+struct keybindings {
+        struct keybinding *entries;
+        size_t capacity; // Power of two
+        size_t len;
+};
+
+// Presentation policies from the config file. A policy named "*" applies to
+// every output (or client) that doesn't have one of its own.
+enum policy_toggle {
+        POLICY_UNSET,
+        POLICY_ON,
+        POLICY_OFF,
+};
+
+struct output_policy {
+        struct wl_list link;
+        char *name; // Output name (e.g. "DP-1") or "*"
+        enum policy_toggle adaptive_sync;
+        enum policy_toggle tearing;
+};
+
+struct client_policy {
+        struct wl_list link;
+        char *app_id; // Toplevel app_id or "*"
+        enum policy_toggle tearing;
+        int commit_budget; // Commits per second, 0 if unset and -1 for no budget
+};
+
+// Keyboard event waiting to be delivered to the focused client
+struct queued_input {
+        bool is_key; // Key event, otherwise a modifiers event
+        struct wlr_keyboard *keyboard; // Source device
+        uint32_t time_msec;
+        uint32_t keycode;
+        uint32_t key_state;
+        struct wlr_keyboard_modifiers modifiers; // Snapshot, the keyboard keeps changing until the flush
+};
+
+// Every workspace has its own scene subtree, only the shown one is enabled.
+// The scene doesn't look at disabled subtrees when rendering, so hidden
+// workspaces cost nothing per frame no matter how many toplevels they hold.
+struct workspace {
+        int index;
+        struct wlr_scene_tree *tree; // Disabled while the workspace is hidden
+        struct wlr_scene_tree *layer_normal; // Regular toplevels
+        struct wlr_scene_tree *layer_floating; // Floating toplevels, above the tiled ones
+        struct wlr_scene_tree *layer_fullscreen; // Fullscreen toplevels, above everything else
+        struct wl_list toplevels; // struct toplevel_info, most recently focused first
+        struct spatial_index spatial_index; // Used for pointer focus
+};
 
 struct state {
         struct wl_display *display;
@@ -24,22 +289,70 @@ struct state {
         struct wlr_renderer *renderer;
         struct wlr_allocator *allocator;
 
+        struct wlr_linux_dmabuf_v1 *linux_dmabuf; // NULL if the renderer can't import dmabufs
+        struct wlr_linux_drm_syncobj_manager_v1 *syncobj_manager; // NULL without explicit sync support
+        struct wlr_tearing_control_manager_v1 *tearing_control;
+
         struct wlr_compositor *compositor;
         struct wlr_subcompositor *subcompositor;
 
         struct wlr_data_device_manager *ddm;
 
         struct wlr_output_layout *output_layout;
+        struct wl_listener listener_output_layout_change;
         struct wl_list outputs;
         struct wl_listener listener_new_output;
 
+        // Lets clients (e.g. wlr-randr, kanshi) configure the outputs
+        struct wlr_output_manager_v1 *output_manager;
+        struct wl_listener listener_output_manager_apply;
+        struct wl_listener listener_output_manager_test;
+        struct wl_list render_queue; // struct output_info, sorted by render deadline
+        struct wl_event_source *render_idle; // Pending render queue dispatch
+
+        // Layout (see layout_flush)
+        enum layout_mode default_layout; // Layout of new outputs
+        double master_ratio; // Share of the output width taken by the master column
+        struct wl_event_source *layout_idle; // Pending re-layout of the dirty containers
+        uint64_t layout_runs; // Containers laid out
+        uint64_t configures_sent;
+        uint64_t configures_skipped; // Toplevels that already had the right size
+
+        // Layout changes of mapped toplevels are applied together once every
+        // resized toplevel committed its new size (see transaction_apply)
+        struct {
+                bool active;
+                struct wl_list toplevels; // struct toplevel_info
+                int waiting; // Toplevels that haven't committed their new size yet
+                int64_t start_ns;
+                int timeout_ms;
+                struct wl_event_source *timer;
+                uint64_t applied;
+                uint64_t timed_out;
+                struct histogram times; // Time from the configures to the transaction being applied
+        } transaction;
+
+        // Frame callback throttling (see output_send_frame_done)
+        int hidden_frame_rate; // Frame callbacks per second for hidden surfaces, 0 for none
+        struct wl_event_source *hidden_frame_timer;
+        bool hidden_frame_timer_armed; // Only while there may be hidden surfaces
+        uint64_t hidden_frames_done; // Frame callbacks sent to hidden surfaces
+        struct wl_event_source *budget_timer; // Ends the wait of clients over their commit budget
+        bool budget_timer_armed;
+        uint32_t budget_timer_msec; // When the armed budget timer fires
+
         struct wlr_scene *scene;
         struct wlr_scene_output_layout *scene_layout;
+        struct wlr_scene_tree *layer_drag_icon; // Follows the cursor during drag and drop
 
         struct wlr_xdg_shell *xdg_shell;
         struct wl_listener listener_xdg_new_toplevel;
         struct wl_listener listener_xdg_new_popup;
-        struct wl_list toplevels;
+        struct workspace workspaces[WORKSPACE_COUNT];
+        struct workspace *workspace; // Shown workspace
+        uint64_t workspace_switches;
+        struct toplevel_info *focused_toplevel;
+        uint64_t stacking_counter; // Last stacking order handed out to a raised toplevel
 
         struct wlr_cursor *cursor;
         struct wlr_xcursor_manager *xcursor_manager;
@@ -48,14 +361,145 @@ struct state {
         struct wl_listener listener_cursor_button;
         struct wl_listener listener_cursor_axis;
         struct wl_listener listener_cursor_frame;
+        struct wlr_relative_pointer_manager_v1 *relative_pointer_manager;
+        struct {
+                enum cursor_image_type type;
+                const char *xcursor_name;
+                struct wlr_surface *surface;
+                int32_t hotspot_x, hotspot_y;
+                struct wl_listener listener_surface_destroy;
+        } cursor_image;
+
+        // Motion coalescing (-m): motion events are accumulated here and
+        // processed once per cursor frame
+        bool coalesce_motion;
+        struct {
+                bool pending;
+                struct wlr_input_device *device; // Device that sent the accumulated events
+                uint32_t time_msec; // Time of the latest accumulated event
+                bool absolute; // An absolute motion happened, warp to (x, y) first
+                double x, y;
+                double dx, dy; // Accelerated delta (after the absolute motion, if any)
+                double unaccel_dx, unaccel_dy; // Raw delta, for relative pointer clients
+        } pending_motion;
+
+        // Axis events of a pointer frame, merged per orientation (see queue_axis)
+        struct {
+                bool pending;
+                uint32_t time_msec; // Time of the latest merged event
+                enum wl_pointer_axis_source source;
+                enum wl_pointer_axis_relative_direction relative_direction;
+                double delta;
+                int32_t delta_discrete; // In value120 units (120 is one wheel detent)
+        } pending_axis[2];
+        uint64_t axis_events; // Axis events received
+        uint64_t axis_sent; // Axis events sent to clients after merging
 
         struct wlr_seat *seat;
         struct wl_list keyboards;
+        struct keybindings keybindings;
+        struct wl_list output_policies; // struct output_policy
+        struct wl_list client_policies; // struct client_policy
+
+        // Keyboard events are queued while the event loop dispatches, then
+        // delivered together once the iteration is done (see input_queue_flush)
+        struct {
+                struct queued_input events[INPUT_QUEUE_SIZE];
+                size_t len;
+                struct wl_event_source *idle; // Pending flush
+                uint64_t delivered; // Events delivered to the seat
+                uint64_t batches; // Flushes
+                uint64_t client_writes; // Clients that got events in a flush, each gets them in a single write
+                uint64_t keyboard_switches; // Times the seat keyboard had to change
+        } input_queue;
+        struct xkb_context *xkb_context; // Shared by all keyboards
+        struct wl_list keymaps; // Compiled keymaps (struct keymap_entry), most recently used first
         struct wl_listener listener_new_input;
         struct wl_listener listener_request_set_cursor;
         struct wl_listener listener_request_set_selection;
+        struct wl_listener listener_request_set_primary_selection;
+        struct wl_listener listener_set_selection;
+        struct wl_listener listener_set_primary_selection;
+        struct wl_listener listener_request_start_drag;
+        struct wl_listener listener_start_drag;
+
+        // Clipboard and primary selection (see clipboard_snapshot_start)
+        struct {
+                struct wlr_primary_selection_v1_device_manager *primary_manager;
+                size_t cache_limit; // Bytes per cached selection, 0 disables the cache
+                struct clipboard_snapshot *snapshots[2]; // Of the selection and the primary selection
+                struct wl_event_source *install_idle; // Pending switch to the cache
+                struct wl_list transfers; // struct clipboard_transfer
+                uint64_t bytes_read;
+                uint64_t bytes_written;
+                uint64_t pastes_served; // Pastes served from the cache
+                int64_t max_stall_ns; // Longest time spent in a single transfer wakeup
+        } clipboard;
 
         char *socket;
+
+        bool frame_delay; // Delay rendering towards the next vblank (see output_frame_delay_ms)
+
+        // Presentation timestamps for clients (wp_presentation), sent by the scene
+        struct wlr_presentation *presentation;
+        bool latency_tracking; // Follow input events to their presentation (-l, see latency_note_input)
+
+        struct bench *bench; // Only set when running the headless benchmark (-B)
+
+        // Session snapshot (-s), written on exit and restored on the next start.
+        // Relaunched toplevels are matched by app_id and title (see session_match).
+        struct {
+                const char *path; // NULL without a snapshot file
+                struct session_entry *entries;
+                size_t len;
+                int workspace; // Shown workspace when the snapshot was taken
+                uint64_t restored; // Toplevels placed from the snapshot
+                struct wl_event_source *timer; // Drops the unmatched entries (see SESSION_GRACE_MS)
+        } session;
+        bool restart; // Start again once shut down
+
+        // Startup profile, from main() to the first frame (see startup_mark)
+        struct {
+                int64_t start_ns;
+                struct {
+                        const char *name;
+                        int64_t ns;
+                } phases[STARTUP_PHASES];
+                int len;
+                bool first_frame; // A frame was committed
+                bool deferred_done; // The setup the first frame doesn't need is done
+                struct wl_event_source *idle; // Pending deferred setup
+                const char *metrics_path; // The metrics socket is part of the deferred setup
+        } startup;
+
+        struct {
+                struct pool outputs; // struct output_info
+                struct pool keyboards; // struct keyboard_info
+                struct pool toplevels; // struct toplevel_info
+                struct pool devices; // struct device_info
+                struct pool clients; // struct client_info
+                struct pool popups; // struct popup_info
+        } pools;
+
+        // Menus are opened over and over with the same positioner, so their
+        // unconstrained geometry is cached (see popup_unconstrain)
+        struct {
+                struct positioner_cache_entry entries[POSITIONER_CACHE_SIZE];
+                uint64_t hits;
+                uint64_t misses;
+        } positioner_cache;
+
+        // Metrics socket (see metrics_init)
+        struct wl_list devices; // struct device_info
+        struct wl_list clients; // struct client_info
+        struct wl_listener listener_client_created;
+        struct {
+                char *path;
+                int fd;
+                struct wl_event_source *source;
+                struct wl_list connections; // struct metrics_connection
+                int connections_len;
+        } metrics;
 };
 
 struct output_info {
@@ -64,471 +508,5979 @@ struct output_info {
                              // server state
         struct state *state;
         struct wlr_output *output;
+        struct wlr_scene_output *scene_output; // NULL while the output isn't part of the layout
         struct wl_listener listener_frame;
         struct wl_listener listener_request_state;
         struct wl_listener listener_destroy;
+
+        // Frame scheduling
+        struct wl_event_source *render_timer; // Fires when a delayed frame should be rendered
+        int64_t render_time_ns; // Smoothed time spent rendering and committing a frame
+        uint64_t frames_rendered;
+        uint64_t frames_skipped; // Frame events that had no damage to render
+
+        // Render queue, outputs with a pending frame are rendered earliest deadline first
+        struct wl_list render_link; // state->render_queue
+        bool render_queued;
+        int64_t frame_event_ns; // When the last frame event fired, right after the previous vblank
+        int64_t render_queued_ns; // When the frame became due (after the frame delay, if any)
+        int64_t render_deadline_ns; // Latest start that still makes the next vblank
+
+        // Frame time stats
+        int64_t frame_time_total_ns;
+        int64_t frame_time_max_ns;
+        int64_t queue_wait_total_ns; // Time spent waiting for other outputs to render
+        int64_t queue_wait_max_ns;
+        uint64_t deadlines_missed; // Frames that started rendering after their deadline
+        struct histogram frame_times;
+
+        // Input latency (-l)
+        struct wl_listener listener_present;
+        int64_t latency_inflight_ns; // Oldest input event in the frame waiting for presentation
+        struct histogram input_latencies; // From the input event to the presentation of the answer
+
+        bool frame_done_withheld; // A client over its commit budget is waiting for a frame callback
+
+        // Layout container, places the toplevels on this output
+        struct {
+                enum layout_mode mode;
+                struct wl_list toplevels; // struct toplevel_info, in tiling order (master first)
+                bool dirty; // Has to be laid out again
+        } layout;
+
+        // Fullscreen and direct scanout, each workspace can have its own
+        // fullscreen toplevel (see output_fullscreen_toplevel)
+        struct toplevel_info *fullscreen_toplevels[WORKSPACE_COUNT];
+        uint64_t scanout_direct; // Fullscreen frames that skipped composition
+        uint64_t scanout_fallback[SCANOUT_FALLBACK_COUNT];
+
+        // Presentation policy
+        bool allow_tearing; // Fullscreen clients may ask for async page flips
+        uint64_t frames_torn; // Frames committed with an async page flip
+        uint64_t tearing_rejected; // Async page flips the backend refused
+};
+
+// Input device, only used for metrics
+struct device_info {
+        struct wl_list link;
+        struct state *state;
+        struct wlr_input_device *device;
+        struct rate_counter events;
+        struct wl_listener listener_destroy;
+};
+
+// Connected client, only used for metrics
+struct client_info {
+        struct wl_list link;
+        struct state *state;
+        struct wl_client *client;
+        pid_t pid;
+        struct rate_counter commits; // Toplevel surface commits
+        int commit_budget; // Commits per second before frame callbacks are withheld, 0 for no budget
+        uint64_t frames_withheld; // Frame callbacks withheld because of the budget
+
+        // Input latency (-l)
+        struct {
+                int64_t input_ns; // Oldest input event the client hasn't committed for yet
+                int64_t committed_ns; // Input event answered by a commit that isn't on screen yet
+                int64_t inflight_ns; // Input event answered by a frame waiting for presentation
+                struct output_info *output; // Output presenting that frame
+                struct histogram to_commit;
+                struct histogram to_present;
+        } latency;
+
+        struct wl_listener listener_destroy;
+};
+
+struct metrics_connection {
+        struct wl_list link;
+        struct state *state;
+        int fd;
+        struct wl_event_source *source;
+        char request[32];
+        size_t request_len;
+        char *response; // Set once the request has been read
+        size_t response_len;
+        size_t written;
+};
+
+// A compiled keymap, shared by all keyboards with the same RMLVO names
+struct keymap_entry {
+        struct wl_list link;
+        struct xkb_rule_names names; // Owned copies, NULL fields use the xkbcommon defaults
+        struct xkb_keymap *keymap;
+        int refs; // Number of keyboards using this keymap
 };
 
 struct keyboard_info {
         struct wl_list link;
         struct state *state;
         struct wlr_keyboard *keyboard;
+        struct keymap_entry *keymap_entry;
+        uint8_t consumed_keys[KEYCODE_MAX / 8 + 1]; // Pressed keys that triggered a keybinding
         struct wl_listener listener_modifiers;
         struct wl_listener listener_key;
         struct wl_listener listener_destroy;
 };
 
 struct toplevel_info {
-        struct wl_list link;
+        struct wl_list link; // In the toplevels of its workspace
         struct state *state;
+        struct workspace *workspace;
         struct wlr_xdg_toplevel *xdg_toplevel;
         struct wlr_scene_tree *scene_tree;
         struct wl_listener listener_map;
         struct wl_listener listener_unmap;
         struct wl_listener listener_commit;
         struct wl_listener listener_destroy;
+        struct wl_listener listener_request_fullscreen;
+        struct wl_listener listener_set_app_id;
+
+        bool allow_tearing; // Client policy, the output has to allow it too
+
+        struct output_info *fullscreen_output; // Set while the toplevel is fullscreen
+        struct wlr_scene_rect *fullscreen_background; // Hides everything below the toplevel while fullscreen
+        struct wlr_box saved_geometry; // Where the toplevel was before going fullscreen
+
+        bool indexed; // Whether the toplevel is in the spatial index
+        struct wlr_box index_box; // Bounding box the toplevel was indexed with
+        uint64_t stacking; // Higher values are stacked on top
+
+        // Layout
+        struct output_info *container; // Output laying out the toplevel, NULL if none
+        struct wl_list container_link;
+        bool floating; // Placed by itself, even in a tiling or monocle container
+        bool placed; // A floating toplevel got its initial position
+        bool configure_pending; // The initial commit still waits for its configure
+
+        // Transaction
+        bool in_transaction;
+        struct wl_list transaction_link;
+        struct wlr_box transaction_box; // Where the toplevel goes once the transaction is applied
+        bool transaction_waiting; // The toplevel hasn't committed its new size yet
+        uint32_t transaction_serial; // Configure carrying the new size
+        struct wlr_scene_tree *snapshot; // Old content, shown while waiting
+
+        // Session
+        bool session_restored; // Placed from the session snapshot
+        bool session_focused; // Had keyboard focus when the snapshot was taken
+        bool mapped_before; // Mapped at least once, a remap isn't matched again
+};
+
+struct popup_info {
+        struct state *state;
+        struct wlr_xdg_popup *xdg_popup;
+        struct toplevel_info *toplevel_info; // Toplevel at the root of the popup chain
+        struct wlr_scene_tree *scene_tree;
+        struct wl_listener listener_commit;
+        struct wl_listener listener_reposition;
+        struct wl_listener listener_destroy;
 };
 
-void handle_output_frame(struct wl_listener *listener, void *data)
+// Session snapshot file: a header followed by one record per toplevel, each
+// record followed by its app_id, title and output name (without terminators).
+// Only read back by the same build, so the structs are written as they are.
+enum session_flags {
+        SESSION_FLOATING = 1 << 0,
+        SESSION_FULLSCREEN = 1 << 1,
+        SESSION_FOCUSED = 1 << 2,
+};
+
+struct session_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t workspace; // Shown workspace
+        uint32_t count; // Records following the header
+};
+
+struct session_record {
+        uint8_t workspace;
+        uint8_t flags; // enum session_flags
+        uint16_t app_id_len;
+        uint16_t title_len;
+        uint16_t output_len;
+        int32_t x, y; // Surface origin of a floating toplevel
+        int32_t width, height; // Window geometry of a floating toplevel, 0 for tiled ones
+};
+
+// Record waiting for its toplevel to come back
+struct session_entry {
+        char *app_id;
+        char *title;
+        char *output; // NULL if the toplevel wasn't on any output
+        int workspace;
+        uint8_t flags;
+        struct wlr_box box;
+        bool used; // Already matched to a toplevel
+};
+
+struct clipboard_entry {
+        struct wl_list link;
+        char *mime_type;
+        char *data;
+        size_t len;
+        size_t capacity;
+        bool complete;
+};
+
+// Copy of a selection, shared by its transfers and the cache source serving it
+struct clipboard_snapshot {
+        struct state *state;
+        int refs;
+        bool primary;
+        struct wl_list entries; // struct clipboard_entry, one per MIME type
+        size_t size; // Bytes in all entries
+        int reading; // Entries still being read
+        int64_t start_ns;
+        int64_t end_ns; // When the last entry was read
+
+        // Client source it's copied from, NULL once the source is destroyed
+        struct wlr_data_source *data_source;
+        struct wlr_primary_selection_source *primary_source;
+        struct wl_listener listener_source_destroy;
+};
+
+// Moves one entry from or to a pipe, a chunk per wakeup
+struct clipboard_transfer {
+        struct wl_list link;
+        struct clipboard_snapshot *snapshot;
+        struct clipboard_entry *entry;
+        int fd;
+        bool reading;
+        size_t offset; // Bytes written so far
+        struct wl_event_source *source;
+};
+
+// Serve a snapshot once the client that owned the selection is gone
+struct cache_data_source {
+        struct wlr_data_source base;
+        struct clipboard_snapshot *snapshot;
+};
+
+struct cache_primary_source {
+        struct wlr_primary_selection_source base;
+        struct clipboard_snapshot *snapshot;
+};
+
+void toplevel_set_fullscreen(struct toplevel_info *toplevel_info, bool fullscreen, struct wlr_output *output);
+void output_update_fullscreen(struct output_info *output_info);
+void layout_mark_dirty(struct output_info *output_info);
+void layout_flush(struct state *state);
+void layout_evacuate(struct output_info *output_info);
+void layout_adopt_orphans(struct output_info *output_info);
+void cursor_theme_load(struct state *state, float scale);
+void startup_first_frame(struct state *state);
+
+// Headless benchmark
+// Runs the compositor on the headless backend with the pixman renderer, spawns
+// synthetic clients committing shm buffers, injects synthetic input and reports
+// frame, latency and resource statistics once the configured duration is over.
+struct bench_samples {
+        int64_t *values;
+        size_t len;
+        size_t capacity;
+};
+
+struct bench {
+        struct state *state;
+
+        // Options
+        int clients;
+        int commit_rate; // Client commits per second
+        int input_rate; // Synthetic pointer events per second
+        int duration; // Seconds
+        int outputs; // Headless outputs to render
+        int clipboard_mib; // Size of the clipboard transfer, 0 for none
+        const char *client_path;
+
+        pid_t *client_pids;
+        struct wlr_output *output; // First output, presentation latency is measured on it
+        struct wlr_pointer pointer;
+        struct wlr_keyboard keyboard;
+        struct wl_event_source *input_timer;
+        struct wl_event_source *end_timer;
+        struct wl_listener listener_present;
+        uint64_t input_events;
+        bool key_pressed;
+
+        int64_t pending_commit_ns; // Oldest client commit not rendered yet
+        int64_t inflight_commit_ns; // Oldest client commit in the frame waiting for presentation
+
+        struct clipboard_snapshot *clipboard_source; // Stands in for the source client
+        struct clipboard_snapshot *clipboard_copy;
+
+        struct bench_samples frame_times;
+        struct bench_samples present_latencies;
+        struct bench_samples input_times;
+        struct timespec start_time;
+        struct rusage start_usage;
+};
+
+// Tracing
+// Hot paths (input, frames, commits) don't log, they record fixed-size binary
+// events into an in-memory ring buffer instead, which is dumped to a file on
+// SIGUSR1 and at exit. When tracing is disabled a trace point costs a single
+// branch, and building with -DNO_TRACE compiles them out completely.
+enum trace_event_type {
+        TRACE_OUTPUT_FRAME,
+        TRACE_OUTPUT_RENDER, // arg0: 1 if rendered, 0 if skipped; arg1: render time (ns)
+        TRACE_CURSOR_MOTION,
+        TRACE_CURSOR_MOTION_ABSOLUTE,
+        TRACE_CURSOR_BUTTON, // arg0: button; arg1: state
+        TRACE_CURSOR_AXIS,
+        TRACE_CURSOR_FRAME,
+        TRACE_KEYBOARD_MODIFIERS,
+        TRACE_KEYBOARD_KEY, // arg0: keycode; arg1: state
+        TRACE_TOPLEVEL_COMMIT,
+        TRACE_TRANSACTION, // arg0: 1 if timed out; arg1: time since the configures (ns)
+        TRACE_REQUEST_SET_CURSOR, // arg0: 1 if accepted, 0 if not from the focused client
+        TRACE_KEYBOARD_DESTROY,
+};
+
+struct trace_event {
+        uint64_t time_ns; // CLOCK_MONOTONIC
+        uint32_t type; // enum trace_event_type
+        uint32_t arg0;
+        uint64_t arg1;
+};
+
+struct trace_ring {
+        bool enabled;
+        const char *path; // Where the ring buffer is dumped
+        atomic_uint_fast64_t head; // Total number of recorded events
+        struct trace_event events[TRACE_RING_SIZE];
+};
+
+struct trace_ring trace_ring;
+
+#ifdef NO_TRACE
+#define TRACE(type, arg0, arg1) do { } while (0)
+#else
+#define TRACE(type, arg0, arg1) \
+        do { \
+                if (trace_ring.enabled) \
+                        trace_record((type), (arg0), (arg1)); \
+        } while (0)
+#endif
+
+void trace_record(uint32_t type, uint32_t arg0, uint64_t arg1)
 {
-        struct output_info *output_info = wl_container_of(listener, output_info, listener_frame);
-        struct wlr_output_event_frame *event = (struct wlr_output_event_frame *)data;
-        struct wlr_scene_output *scene_output;
+        struct trace_event *event;
         struct timespec now;
+        uint64_t index;
 
-        wlr_log(WLR_INFO, "Output frame");
+        // Reserve a slot first, so this stays lock-free even with multiple producers.
+        // Once the ring is full the oldest events get overwritten.
+        index = atomic_fetch_add_explicit(&trace_ring.head, 1, memory_order_relaxed);
+        event = &trace_ring.events[index & (TRACE_RING_SIZE - 1)];
 
-        // Get the scene output for this output and commit changes (if needed)
-        scene_output = wlr_scene_get_scene_output(output_info->state->scene, output_info->output);
-        wlr_scene_output_commit(scene_output, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        event->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        event->type = type;
+        event->arg0 = arg0;
+        event->arg1 = arg1;
+}
+
+void trace_dump(void)
+{
+        FILE *file;
+        uint64_t head, first, count, i;
+        const uint32_t header[2] = { 0x43525457 /* "WTRC" */, sizeof(struct trace_event) };
+
+        if (!trace_ring.enabled)
+                return;
+
+        head = atomic_load_explicit(&trace_ring.head, memory_order_acquire);
+        count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+        first = head - count;
+
+        file = fopen(trace_ring.path, "wb");
+        if (!file) {
+                wlr_log_errno(WLR_ERROR, "Failed to open trace file '%s'", trace_ring.path);
+                return;
+        }
+
+        // Layout: magic, event size, event count, then the events from oldest to newest
+        fwrite(header, sizeof(header), 1, file);
+        fwrite(&count, sizeof(count), 1, file);
+        for (i = first; i < head; ++i)
+                fwrite(&trace_ring.events[i & (TRACE_RING_SIZE - 1)], sizeof(struct trace_event), 1, file);
 
-        // Complete the queued frame callbacks for all surfaces of this scene output
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_scene_output_send_frame_done(scene_output, &now);
+        fclose(file);
+        wlr_log(WLR_INFO, "Dumped %lu trace events to '%s'", (unsigned long)count, trace_ring.path);
 }
 
-void handle_output_request_state(struct wl_listener *listener, void *data)
+int handle_trace_signal(int signal_number, void *data)
 {
-        struct output_info *output_info = wl_container_of(listener, output_info, listener_request_state);
-        struct wlr_output_event_request_state *event = (struct wlr_output_event_request_state *)data;
-        
-        wlr_log(WLR_INFO, "Output request state");
+        trace_dump();
+        return 0;
+}
 
-        // Simply commit the requested output state, no questions asked
-        wlr_output_commit_state(output_info->output, event->state);
+int64_t timespec_to_ns(const struct timespec *ts)
+{
+        return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
 }
 
-void handle_output_destroy(struct wl_listener *listener, void *data)
+int64_t now_ns(void)
 {
-        struct output_info *output_info = wl_container_of(listener, output_info, listener_destroy);
-        struct state *state = output_info->state;
+        struct timespec now;
 
-        wlr_log(WLR_INFO, "Output destroy");
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return timespec_to_ns(&now);
+}
 
-        wl_list_remove(&output_info->listener_frame.link);
-        wl_list_remove(&output_info->listener_request_state.link);
-        wl_list_remove(&output_info->listener_destroy.link);
+void bench_sample(struct bench_samples *samples, int64_t value)
+{
+        int64_t *values;
+        size_t capacity;
 
-        // Remove output from outputs
-        wl_list_remove(&output_info->link);
+        if (samples->len == samples->capacity) {
+                capacity = samples->capacity ? samples->capacity * 2 : 1024;
+                values = realloc(samples->values, capacity * sizeof(*values));
+                if (!values)
+                        return; // Losing samples is better than aborting the benchmark
+                samples->values = values;
+                samples->capacity = capacity;
+        }
 
-        free(output_info);
+        samples->values[samples->len++] = value;
+}
 
-        // Quit if there aren't any displays left
-        // TODO: Check if this can lead to issues or not
-        if (wl_list_empty(&state->outputs))
-                wl_display_terminate(state->display);
+void pool_init(struct pool *pool, const char *name, size_t object_size)
+{
+        size_t align = _Alignof(max_align_t);
+
+        memset(pool, 0, sizeof(*pool));
+        pool->name = name;
+        if (object_size < sizeof(struct pool_free))
+                object_size = sizeof(struct pool_free);
+        pool->object_size = (object_size + align - 1) / align * align;
 }
 
-void handle_new_output(struct wl_listener *listener, void *data)
+bool pool_grow(struct pool *pool)
 {
-        // NOTE: wl_container_of is basically a fancy `offsetof`
-        struct state *state = (struct state *)wl_container_of(listener, state, listener_new_output);
-        struct wlr_output *output = (struct wlr_output *)data;
-        struct wlr_output_state output_state;
-        struct wlr_output_mode *output_mode;
-        struct output_info *output_info;
-        struct wlr_output_layout_output *layout_output;
-        struct wlr_scene_output *scene_output;
+        struct pool_slab *slab;
+        struct pool_free *object;
+        size_t i;
 
-        wlr_log(WLR_INFO, "New output");
+        slab = malloc(sizeof(*slab) + pool->object_size * POOL_SLAB_OBJECTS);
+        if (!slab)
+                return false;
 
-        // Configure output to use our renderer and allocator
-        wlr_output_init_render(output, state->allocator, state->renderer);
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        ++pool->slabs_len;
 
-        // Turn on the output if it's disabled
-        wlr_output_state_init(&output_state);
-        wlr_output_state_set_enabled(&output_state, true);
+        // Push the objects backwards, so they're handed out in address order
+        for (i = POOL_SLAB_OBJECTS; i-- > 0;) {
+                object = (struct pool_free *)(slab->objects + i * pool->object_size);
+                object->next = pool->free_list;
+                pool->free_list = object;
+        }
+
+        return true;
+}
+
+// Returns a zeroed object, or NULL if we're out of memory
+void *pool_alloc(struct pool *pool)
+{
+        struct pool_free *object;
+
+        if (!pool->free_list && !pool_grow(pool))
+                return NULL;
+
+        object = pool->free_list;
+        pool->free_list = object->next;
+
+        ++pool->live;
+        if (pool->live > pool->high_water)
+                pool->high_water = pool->live;
+
+        memset(object, 0, pool->object_size);
+        return object;
+}
+
+void pool_free(struct pool *pool, void *ptr)
+{
+        struct pool_free *object = (struct pool_free *)ptr;
+
+        if (!object)
+                return;
+
+        object->next = pool->free_list;
+        pool->free_list = object;
+        --pool->live;
+}
+
+void pool_finish(struct pool *pool)
+{
+        struct pool_slab *slab, *next;
+
+        wlr_log(WLR_INFO, "Pool '%s': %zu live, %zu high water, %zu slabs of %d objects (%zu bytes each)",
+                pool->name, pool->live, pool->high_water, pool->slabs_len, POOL_SLAB_OBJECTS, pool->object_size);
+
+        for (slab = pool->slabs; slab; slab = next) {
+                next = slab->next;
+                free(slab);
+        }
+
+        memset(pool, 0, sizeof(*pool));
+}
+
+void policy_apply(enum policy_toggle toggle, bool *value)
+{
+        if (toggle != POLICY_UNSET)
+                *value = toggle == POLICY_ON;
+}
+
+// Resolve the policy of an output, settings of its own policy take precedence over "*"
+void output_policy_resolve(struct state *state, const char *name, bool *adaptive_sync, bool *tearing)
+{
+        struct output_policy *policy;
+
+        // Adaptive sync is harmless on static content (the output just keeps its
+        // maximum refresh rate), and tearing still needs a fullscreen client asking for it
+        *adaptive_sync = true;
+        *tearing = true;
+
+        wl_list_for_each(policy, &state->output_policies, link) {
+                if (strcmp(policy->name, "*") == 0) {
+                        policy_apply(policy->adaptive_sync, adaptive_sync);
+                        policy_apply(policy->tearing, tearing);
+                }
+        }
+
+        wl_list_for_each(policy, &state->output_policies, link) {
+                if (strcmp(policy->name, name) == 0) {
+                        policy_apply(policy->adaptive_sync, adaptive_sync);
+                        policy_apply(policy->tearing, tearing);
+                }
+        }
+}
+
+void client_policy_apply(struct client_policy *policy, bool *tearing, int *commit_budget)
+{
+        policy_apply(policy->tearing, tearing);
+        if (policy->commit_budget != 0)
+                *commit_budget = policy->commit_budget > 0 ? policy->commit_budget : 0;
+}
+
+// Resolve the policy of a client, settings for its app_id take precedence over "*"
+void client_policy_resolve(struct state *state, const char *app_id, bool *tearing, int *commit_budget)
+{
+        struct client_policy *policy;
+
+        *tearing = true;
+        *commit_budget = 0;
+
+        wl_list_for_each(policy, &state->client_policies, link) {
+                if (strcmp(policy->app_id, "*") == 0)
+                        client_policy_apply(policy, tearing, commit_budget);
+        }
+
+        if (app_id) {
+                wl_list_for_each(policy, &state->client_policies, link) {
+                        if (strcmp(policy->app_id, app_id) == 0)
+                                client_policy_apply(policy, tearing, commit_budget);
+                }
+        }
+}
+
+void policies_finish(struct state *state)
+{
+        struct output_policy *output_policy, *output_tmp;
+        struct client_policy *client_policy, *client_tmp;
+
+        wl_list_for_each_safe(output_policy, output_tmp, &state->output_policies, link) {
+                wl_list_remove(&output_policy->link);
+                free(output_policy->name);
+                free(output_policy);
+        }
+
+        wl_list_for_each_safe(client_policy, client_tmp, &state->client_policies, link) {
+                wl_list_remove(&client_policy->link);
+                free(client_policy->app_id);
+                free(client_policy);
+        }
+}
+
+// Fullscreen toplevel of the output on the shown workspace, if any
+struct toplevel_info *output_fullscreen_toplevel(struct output_info *output_info)
+{
+        return output_info->fullscreen_toplevels[output_info->state->workspace->index];
+}
+
+// Whether the next frame of this output can be an async page flip
+bool output_wants_tearing(struct output_info *output_info)
+{
+        struct toplevel_info *toplevel_info = output_fullscreen_toplevel(output_info);
+
+        // Only a fullscreen client owns the whole output, tearing anything
+        // else would also tear the windows that didn't ask for it
+        if (!output_info->allow_tearing || !toplevel_info || !toplevel_info->allow_tearing)
+                return false;
+
+        return wlr_tearing_control_manager_v1_surface_hint_from_surface(output_info->state->tearing_control,
+                toplevel_info->xdg_toplevel->base->surface) == WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC;
+}
+
+void histogram_add(struct histogram *histogram, int64_t value_ns)
+{
+        int64_t us = value_ns / 1000;
+        int bucket = 0;
+
+        while (us > 0 && bucket < HISTOGRAM_BUCKETS - 1) {
+                us >>= 1;
+                ++bucket;
+        }
+
+        ++histogram->buckets[bucket];
+        ++histogram->count;
+        histogram->sum_ns += value_ns;
+}
+
+// Counting has to stay cheap, it runs for every input event and commit,
+// so the rate is only updated when a one second window ends. The event loop
+// is single threaded, plain integers are enough.
+void rate_counter_add(struct rate_counter *counter, uint32_t time_msec)
+{
+        uint32_t elapsed = time_msec - counter->window_start_msec;
+
+        if (elapsed >= 1000) {
+                // A longer gap means the previous second had no events at all
+                counter->rate = elapsed < 2000 ? counter->window_count : 0;
+                counter->window_start_msec = time_msec;
+                counter->window_count = 0;
+        }
+
+        ++counter->window_count;
+        ++counter->total;
+}
+
+uint64_t rate_counter_get(const struct rate_counter *counter, uint32_t now_msec)
+{
+        uint32_t elapsed = now_msec - counter->window_start_msec;
+
+        if (elapsed >= 2000)
+                return 0;
+        if (elapsed >= 1000)
+                return counter->window_count;
+        return counter->rate;
+}
+
+void device_count_event(struct wlr_input_device *device, uint32_t time_msec)
+{
+        struct device_info *device_info = (struct device_info *)device->data;
+
+        if (device_info)
+                rate_counter_add(&device_info->events, time_msec);
+}
+
+void output_count_scanout(struct output_info *output_info, const struct wlr_output_state *output_state)
+{
+        struct toplevel_info *toplevel_info = output_fullscreen_toplevel(output_info);
+        struct wlr_surface *surface;
+        struct wlr_buffer *buffer;
+        struct wlr_dmabuf_attributes dmabuf;
+        int width, height;
+
+        if (!toplevel_info)
+                return;
+
+        surface = toplevel_info->xdg_toplevel->base->surface;
+        buffer = surface->buffer ? &surface->buffer->base : NULL;
+
+        // The scene hands the client buffer to the output as-is when it can scan it out
+        if (buffer && output_state->buffer == buffer) {
+                ++output_info->scanout_direct;
+                return;
+        }
+
+        wlr_output_effective_resolution(output_info->output, &width, &height);
+        if (!buffer)
+                ++output_info->scanout_fallback[SCANOUT_FALLBACK_NO_BUFFER];
+        else if (!wlr_buffer_get_dmabuf(buffer, &dmabuf))
+                ++output_info->scanout_fallback[SCANOUT_FALLBACK_NOT_DMABUF];
+        else if (surface->current.width != width || surface->current.height != height)
+                ++output_info->scanout_fallback[SCANOUT_FALLBACK_SIZE];
+        else
+                ++output_info->scanout_fallback[SCANOUT_FALLBACK_COMPOSITED];
+}
+
+void handle_client_destroy(struct wl_listener *listener, void *data)
+{
+        struct client_info *client_info = wl_container_of(listener, client_info, listener_destroy);
+
+        wl_list_remove(&client_info->listener_destroy.link);
+        wl_list_remove(&client_info->link);
+        pool_free(&client_info->state->pools.clients, client_info);
+}
+
+void handle_client_created(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_client_created);
+        struct wl_client *client = (struct wl_client *)data;
+        struct client_info *client_info;
+
+        client_info = (struct client_info *)pool_alloc(&state->pools.clients);
+        if (!client_info) {
+                wl_client_post_no_memory(client);
+                return;
+        }
+
+        client_info->state = state;
+        client_info->client = client;
+        wl_client_get_credentials(client, &client_info->pid, NULL, NULL);
+        client_info->listener_destroy.notify = handle_client_destroy;
+        wl_client_add_destroy_listener(client, &client_info->listener_destroy);
+        wl_list_insert(state->clients.prev, &client_info->link);
+}
+
+// Our destroy listener doubles as the per-client lookup
+struct client_info *client_info_from_client(struct wl_client *client)
+{
+        struct client_info *client_info;
+        struct wl_listener *listener;
+
+        listener = wl_client_get_destroy_listener(client, handle_client_destroy);
+        if (!listener)
+                return NULL;
+
+        return wl_container_of(listener, client_info, listener_destroy);
+}
+
+// Input latency
+// With -l, the oldest input event sent to a client is followed through the
+// client's next commit and the frame containing that commit, up to the
+// present event of the output. Only one event per client is in flight at a
+// time, which keeps the bookkeeping to a few fields per client.
+
+// Input events carry the low 32 bits of their CLOCK_MONOTONIC time in milliseconds
+int64_t input_time_ns(uint32_t time_msec)
+{
+        int64_t now = now_ns();
+        uint32_t age_msec = (uint32_t)(now / 1000000) - time_msec;
+
+        // Devices with timestamps from the future (or a minute old) aren't worth the guess
+        if (age_msec > 60000)
+                return now;
+
+        return now - (int64_t)age_msec * 1000000;
+}
+
+void latency_note_input(struct state *state, struct wlr_surface *surface, uint32_t time_msec)
+{
+        struct client_info *client_info;
+
+        if (!state->latency_tracking || !surface)
+                return;
+
+        client_info = client_info_from_client(wl_resource_get_client(surface->resource));
+        if (client_info && !client_info->latency.input_ns)
+                client_info->latency.input_ns = input_time_ns(time_msec);
+}
+
+// Any commit after an input event counts as the answer, we can't tell better
+void latency_note_commit(struct client_info *client_info)
+{
+        if (!client_info->latency.input_ns)
+                return;
+
+        histogram_add(&client_info->latency.to_commit, now_ns() - client_info->latency.input_ns);
+        if (!client_info->latency.committed_ns)
+                client_info->latency.committed_ns = client_info->latency.input_ns;
+        client_info->latency.input_ns = 0;
+}
+
+void latency_latch_iterator(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+        struct output_info *output_info = (struct output_info *)data;
+        struct wlr_scene_surface *scene_surface;
+        struct client_info *client_info;
+
+        if (!buffer->primary_output || buffer->primary_output->output != output_info->output)
+                return;
+
+        scene_surface = wlr_scene_surface_try_from_buffer(buffer);
+        if (!scene_surface)
+                return;
+
+        // A client whose previous answer is still waiting for its output keeps
+        // the new one for the next frame
+        client_info = client_info_from_client(wl_resource_get_client(scene_surface->surface->resource));
+        if (!client_info || !client_info->latency.committed_ns || client_info->latency.output)
+                return;
+
+        client_info->latency.inflight_ns = client_info->latency.committed_ns;
+        client_info->latency.output = output_info;
+        client_info->latency.committed_ns = 0;
+        if (!output_info->latency_inflight_ns || client_info->latency.inflight_ns < output_info->latency_inflight_ns)
+                output_info->latency_inflight_ns = client_info->latency.inflight_ns;
+}
+
+// Called before committing a frame, some backends present it during the commit
+void output_latch_latency(struct output_info *output_info, struct wlr_scene_output *scene_output)
+{
+        if (output_info->state->latency_tracking)
+                wlr_scene_output_for_each_buffer(scene_output, latency_latch_iterator, output_info);
+}
+
+void handle_output_present(struct wl_listener *listener, void *data)
+{
+        struct output_info *output_info = wl_container_of(listener, output_info, listener_present);
+        struct wlr_output_event_present *event = (struct wlr_output_event_present *)data;
+        struct client_info *client_info;
+        int64_t present_ns;
+
+        // A discarded frame is replaced by the next one, which shows the same content
+        if (!output_info->latency_inflight_ns || !event->presented)
+                return;
+
+        present_ns = event->when ? timespec_to_ns(event->when) : now_ns();
+        histogram_add(&output_info->input_latencies, present_ns - output_info->latency_inflight_ns);
+        output_info->latency_inflight_ns = 0;
+
+        wl_list_for_each(client_info, &output_info->state->clients, link) {
+                if (client_info->latency.output != output_info)
+                        continue;
+
+                histogram_add(&client_info->latency.to_present, present_ns - client_info->latency.inflight_ns);
+                client_info->latency.inflight_ns = 0;
+                client_info->latency.output = NULL;
+        }
+}
+
+struct frame_done_data {
+        struct output_info *output_info;
+        struct wlr_scene_output *scene_output;
+        struct timespec *now;
+        uint32_t now_msec;
+        uint32_t budget_wait_msec; // Until the first withheld client's budget window is over
+};
+
+// The timer only runs while something is hidden, it stops by itself once
+// there's nothing left to send frame callbacks to
+void hidden_frame_timer_arm(struct state *state)
+{
+        if (!state->hidden_frame_timer || state->hidden_frame_timer_armed)
+                return;
+
+        wl_event_source_timer_update(state->hidden_frame_timer, 1000 / state->hidden_frame_rate);
+        state->hidden_frame_timer_armed = true;
+}
+
+bool client_over_budget(struct client_info *client_info, uint32_t now_msec)
+{
+        return client_info->commit_budget > 0 &&
+               now_msec - client_info->commits.window_start_msec < 1000 &&
+               client_info->commits.window_count >= (uint64_t)client_info->commit_budget;
+}
+
+void output_send_frame_done_iterator(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+        struct frame_done_data *frame_done = (struct frame_done_data *)data;
+        struct wlr_scene_surface *scene_surface;
+        struct client_info *client_info;
+        uint32_t wait_msec;
+
+        // Surfaces are paced by the output they're mostly visible on. Hidden
+        // surfaces (fully occluded or off-screen) have no primary output, they
+        // get their frame callbacks from the hidden frame timer instead.
+        if (!buffer->primary_output)
+                hidden_frame_timer_arm(frame_done->output_info->state);
+        if (buffer->primary_output != frame_done->scene_output)
+                return;
+
+        // A client that used up its commit budget for this second doesn't get
+        // frame callbacks until the second is over, which makes well-behaved
+        // clients slow down to the budget
+        scene_surface = wlr_scene_surface_try_from_buffer(buffer);
+        if (scene_surface) {
+                client_info = client_info_from_client(wl_resource_get_client(scene_surface->surface->resource));
+                if (client_info && client_over_budget(client_info, frame_done->now_msec)) {
+                        ++client_info->frames_withheld;
+                        frame_done->output_info->frame_done_withheld = true;
+                        wait_msec = client_info->commits.window_start_msec + 1000 - frame_done->now_msec;
+                        if (wait_msec < frame_done->budget_wait_msec)
+                                frame_done->budget_wait_msec = wait_msec;
+                        return;
+                }
+        }
+
+        wlr_scene_buffer_send_frame_done(buffer, frame_done->now);
+}
+
+// Replacement for wlr_scene_output_send_frame_done that throttles clients
+// over their commit budget
+void output_send_frame_done(struct output_info *output_info, struct wlr_scene_output *scene_output, struct timespec *now)
+{
+        struct state *state = output_info->state;
+        struct frame_done_data frame_done = {
+                .output_info = output_info,
+                .scene_output = scene_output,
+                .now = now,
+                .now_msec = (uint32_t)(timespec_to_ns(now) / 1000000),
+                .budget_wait_msec = 1000,
+        };
+        uint32_t fire_msec;
+
+        output_info->frame_done_withheld = false;
+        wlr_scene_output_for_each_buffer(scene_output, output_send_frame_done_iterator, &frame_done);
+
+        // Nothing may damage the output until the budget window is over, so
+        // make sure there's a frame then to release the withheld callbacks.
+        // Windows are per client, the timer fires when the earliest one ends.
+        if (!output_info->frame_done_withheld)
+                return;
+
+        fire_msec = frame_done.now_msec + frame_done.budget_wait_msec;
+        if (!state->budget_timer_armed || (int32_t)(fire_msec - state->budget_timer_msec) < 0) {
+                // A delay of 0 would disarm the timer
+                wl_event_source_timer_update(state->budget_timer, frame_done.budget_wait_msec ? frame_done.budget_wait_msec : 1);
+                state->budget_timer_armed = true;
+                state->budget_timer_msec = fire_msec;
+        }
+}
+
+int handle_budget_timer(void *data)
+{
+        struct state *state = (struct state *)data;
+        struct output_info *output_info;
+
+        state->budget_timer_armed = false;
+        wl_list_for_each(output_info, &state->outputs, link) {
+                if (output_info->frame_done_withheld)
+                        wlr_output_schedule_frame(output_info->output);
+        }
+
+        return 0;
+}
+
+void hidden_frame_done_iterator(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+        struct state *state = (struct state *)data;
+        struct timespec now;
+
+        if (buffer->primary_output)
+                return;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wlr_scene_buffer_send_frame_done(buffer, &now);
+        ++state->hidden_frames_done;
+}
+
+void hidden_workspace_frame_done_iterator(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+        struct state *state = (struct state *)data;
+        struct timespec now;
+
+        // Occluded as a whole, whatever output the buffer was last shown on
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wlr_scene_buffer_send_frame_done(buffer, &now);
+        ++state->hidden_frames_done;
+}
+
+// Hidden surfaces still get the occasional frame callback, some clients block
+// until they get one and would never notice they became visible again otherwise.
+// Everything on a hidden workspace counts as hidden.
+int handle_hidden_frame_timer(void *data)
+{
+        struct state *state = (struct state *)data;
+        struct toplevel_info *toplevel_info;
+        struct workspace *workspace;
+        uint64_t frames_done = state->hidden_frames_done;
+
+        for (workspace = state->workspaces; workspace < state->workspaces + WORKSPACE_COUNT; ++workspace) {
+                wl_list_for_each(toplevel_info, &workspace->toplevels, link) {
+                        wlr_scene_node_for_each_buffer(&toplevel_info->scene_tree->node, workspace == state->workspace ?
+                                hidden_frame_done_iterator : hidden_workspace_frame_done_iterator, state);
+                }
+        }
+
+        // Nothing hidden anymore, rendering (or hiding a workspace) arms the timer again
+        state->hidden_frame_timer_armed = false;
+        if (state->hidden_frames_done != frames_done)
+                hidden_frame_timer_arm(state);
+
+        return 0;
+}
+
+void output_render(struct output_info *output_info)
+{
+        struct wlr_scene_output *scene_output;
+        struct wlr_output_state output_state;
+        struct timespec start, now;
+        int64_t elapsed;
+
+        scene_output = wlr_scene_get_scene_output(output_info->state->scene, output_info->output);
+        if (!scene_output)
+                return;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        // Benchmark: the client commits waiting so far will be part of this frame
+        if (output_info->state->bench && wlr_scene_output_needs_frame(scene_output) &&
+            !output_info->state->bench->inflight_commit_ns) {
+                output_info->state->bench->inflight_commit_ns = output_info->state->bench->pending_commit_ns;
+                output_info->state->bench->pending_commit_ns = 0;
+        }
+
+        // Only render and commit if something on this output was damaged (or the
+        // backend explicitly asked for a new frame), otherwise the output can stay idle
+        if (wlr_scene_output_needs_frame(scene_output)) {
+                // Build the state ourselves (instead of wlr_scene_output_commit) so we
+                // can tell whether the scene managed to skip composition
+                wlr_output_state_init(&output_state);
+                if (wlr_scene_output_build_state(scene_output, &output_state, NULL)) {
+                        output_count_scanout(output_info, &output_state);
+                        output_latch_latency(output_info, scene_output);
+                        output_state.tearing_page_flip = output_wants_tearing(output_info);
+                        if (wlr_output_commit_state(output_info->output, &output_state)) {
+                                if (output_state.tearing_page_flip)
+                                        ++output_info->frames_torn;
+                        } else if (output_state.tearing_page_flip) {
+                                // Not every backend (or every buffer) can do async
+                                // page flips, present this frame with vsync instead
+                                ++output_info->tearing_rejected;
+                                output_state.tearing_page_flip = false;
+                                wlr_output_commit_state(output_info->output, &output_state);
+                        }
+                        if (!output_info->state->startup.first_frame)
+                                startup_first_frame(output_info->state);
+                }
+                wlr_output_state_finish(&output_state);
+                clock_gettime(CLOCK_MONOTONIC, &now);
+
+                // Track the render time so we know how late we can start rendering.
+                // Slow frames are taken into account immediately, fast frames only
+                // decay the estimate slowly, so one lucky frame doesn't make us miss vblank.
+                elapsed = timespec_to_ns(&now) - timespec_to_ns(&start);
+                if (elapsed > output_info->render_time_ns)
+                        output_info->render_time_ns = elapsed;
+                else
+                        output_info->render_time_ns = (output_info->render_time_ns * 7 + elapsed) / 8;
+
+                ++output_info->frames_rendered;
+                output_info->frame_time_total_ns += elapsed;
+                histogram_add(&output_info->frame_times, elapsed);
+                if (elapsed > output_info->frame_time_max_ns)
+                        output_info->frame_time_max_ns = elapsed;
+                TRACE(TRACE_OUTPUT_RENDER, 1, elapsed);
+
+                if (output_info->state->bench)
+                        bench_sample(&output_info->state->bench->frame_times, elapsed);
+        } else {
+                now = start;
+                ++output_info->frames_skipped;
+                TRACE(TRACE_OUTPUT_RENDER, 0, 0);
+        }
+
+        // Complete the queued frame callbacks for all surfaces of this scene output.
+        // This is still needed without damage, since clients can ask for a frame
+        // callback without attaching a new buffer.
+        output_send_frame_done(output_info, scene_output, &now);
+}
+
+int output_frame_delay_ms(struct output_info *output_info)
+{
+        int64_t refresh_ns, delay_ns;
+
+        // The frame event fires right after the previous vblank, so we have a whole
+        // refresh period until the next one. Start rendering as late as possible
+        // (minus the measured render time and a safety margin) so that the frame
+        // contains the most recent client content and input.
+        if (output_info->output->refresh <= 0)
+                return 0;
+
+        refresh_ns = 1000000000000LL / output_info->output->refresh; // refresh is in mHz
+        delay_ns = refresh_ns - output_info->render_time_ns - FRAME_DELAY_MARGIN_NS;
+        if (delay_ns <= 0)
+                return 0;
+
+        return (int)(delay_ns / 1000000);
+}
+
+// Render queue
+// All outputs are rendered on the event loop thread (neither the renderer nor
+// the scene can be used from several threads), so a slow output delays every
+// output rendered after it. Instead of rendering in whatever order the frame
+// events are dispatched, due outputs are queued and rendered once the loop
+// iteration is done, the one closest to missing its vblank first.
+void render_queue_dispatch(struct state *state)
+{
+        struct output_info *output_info;
+        int64_t start, wait;
+
+        if (state->render_idle) {
+                wl_event_source_remove(state->render_idle);
+                state->render_idle = NULL;
+        }
+
+        while (!wl_list_empty(&state->render_queue)) {
+                output_info = wl_container_of(state->render_queue.next, output_info, render_link);
+                wl_list_remove(&output_info->render_link);
+                output_info->render_queued = false;
+
+                start = now_ns();
+                wait = start - output_info->render_queued_ns;
+                output_info->queue_wait_total_ns += wait;
+                if (wait > output_info->queue_wait_max_ns)
+                        output_info->queue_wait_max_ns = wait;
+                if (start > output_info->render_deadline_ns)
+                        ++output_info->deadlines_missed;
+
+                output_render(output_info);
+        }
+}
+
+void handle_render_queue_idle(void *data)
+{
+        struct state *state = (struct state *)data;
+
+        // The idle source is destroyed after this callback returns
+        state->render_idle = NULL;
+        render_queue_dispatch(state);
+}
+
+void output_queue_render(struct output_info *output_info)
+{
+        struct state *state = output_info->state;
+        struct output_info *queued;
+        struct wl_list *position;
+        int64_t refresh_ns = 0;
+
+        if (output_info->render_queued)
+                return;
+
+        // The next vblank is a refresh period after the frame event, not after
+        // the queueing: with a frame delay most of the period is already gone
+        output_info->render_queued_ns = now_ns();
+        if (output_info->output->refresh > 0)
+                refresh_ns = 1000000000000LL / output_info->output->refresh; // refresh is in mHz
+        output_info->render_deadline_ns = output_info->frame_event_ns + refresh_ns - output_info->render_time_ns;
+
+        // Insert sorted, there are only a handful of outputs
+        position = &state->render_queue;
+        wl_list_for_each(queued, &state->render_queue, render_link) {
+                if (queued->render_deadline_ns > output_info->render_deadline_ns)
+                        break;
+                position = &queued->render_link;
+        }
+        wl_list_insert(position, &output_info->render_link);
+        output_info->render_queued = true;
+
+        if (!state->render_idle)
+                state->render_idle = wl_event_loop_add_idle(state->event_loop, handle_render_queue_idle, state);
+}
+
+void output_unqueue_render(struct output_info *output_info)
+{
+        if (!output_info->render_queued)
+                return;
+
+        wl_list_remove(&output_info->render_link);
+        output_info->render_queued = false;
+}
+
+int handle_output_render_timer(void *data)
+{
+        struct output_info *output_info = (struct output_info *)data;
+
+        output_queue_render(output_info);
+
+        return 0;
+}
+
+void handle_output_frame(struct wl_listener *listener, void *data)
+{
+        struct output_info *output_info = wl_container_of(listener, output_info, listener_frame);
+        int delay_ms = 0;
+
+        TRACE(TRACE_OUTPUT_FRAME, 0, 0);
+
+        output_info->frame_event_ns = now_ns();
+        if (output_info->state->frame_delay)
+                delay_ms = output_frame_delay_ms(output_info);
+
+        // A delay of 0 would disarm the timer, so render right away in that case
+        if (delay_ms > 0)
+                wl_event_source_timer_update(output_info->render_timer, delay_ms);
+        else
+                output_queue_render(output_info);
+}
+
+void handle_output_request_state(struct wl_listener *listener, void *data)
+{
+        struct output_info *output_info = wl_container_of(listener, output_info, listener_request_state);
+        struct wlr_output_event_request_state *event = (struct wlr_output_event_request_state *)data;
+        
+        wlr_log(WLR_INFO, "Output request state");
+
+        // Simply commit the requested output state, no questions asked
+        if (!wlr_output_commit_state(output_info->output, event->state))
+                wlr_log(WLR_ERROR, "Output '%s' rejected the requested state", output_info->output->name);
+
+        if (event->state->committed & WLR_OUTPUT_STATE_SCALE)
+                cursor_theme_load(output_info->state, output_info->output->scale);
+
+        // The usable area may have changed
+        if (event->state->committed & (WLR_OUTPUT_STATE_MODE | WLR_OUTPUT_STATE_SCALE | WLR_OUTPUT_STATE_TRANSFORM)) {
+                layout_mark_dirty(output_info);
+                output_update_fullscreen(output_info);
+        }
+}
+
+void output_release_fullscreen(struct output_info *output_info)
+{
+        int i;
+
+        for (i = 0; i < WORKSPACE_COUNT; ++i) {
+                if (output_info->fullscreen_toplevels[i])
+                        toplevel_set_fullscreen(output_info->fullscreen_toplevels[i], false, NULL);
+        }
+}
+
+void handle_output_destroy(struct wl_listener *listener, void *data)
+{
+        struct output_info *output_info = wl_container_of(listener, output_info, listener_destroy);
+        struct state *state = output_info->state;
+        struct client_info *client_info;
+
+        wlr_log(WLR_INFO, "Output destroy");
+        wlr_log(WLR_INFO, "Output '%s': %lu direct scanout frames, fallbacks: %lu no buffer, "
+                "%lu not dmabuf, %lu size mismatch, %lu composited", output_info->output->name,
+                (unsigned long)output_info->scanout_direct,
+                (unsigned long)output_info->scanout_fallback[SCANOUT_FALLBACK_NO_BUFFER],
+                (unsigned long)output_info->scanout_fallback[SCANOUT_FALLBACK_NOT_DMABUF],
+                (unsigned long)output_info->scanout_fallback[SCANOUT_FALLBACK_SIZE],
+                (unsigned long)output_info->scanout_fallback[SCANOUT_FALLBACK_COMPOSITED]);
+        wlr_log(WLR_INFO, "Output '%s': %lu frames, %.3f ms average frame time, %.3f ms max, "
+                "%.3f ms max queue wait, %lu deadlines missed", output_info->output->name,
+                (unsigned long)output_info->frames_rendered,
+                output_info->frames_rendered ? output_info->frame_time_total_ns / 1e6 / output_info->frames_rendered : 0,
+                output_info->frame_time_max_ns / 1e6, output_info->queue_wait_max_ns / 1e6,
+                (unsigned long)output_info->deadlines_missed);
+        wlr_log(WLR_INFO, "Output '%s': %lu torn frames, %lu async page flips rejected", output_info->output->name,
+                (unsigned long)output_info->frames_torn, (unsigned long)output_info->tearing_rejected);
+
+        // The fullscreen toplevels go back to being regular windows
+        output_release_fullscreen(output_info);
+
+        // Hand our toplevels over to another output
+        layout_evacuate(output_info);
+
+        if (state->latency_tracking)
+                wlr_log(WLR_INFO, "Output '%s': %lu frames answering input, %.3f ms average input latency",
+                        output_info->output->name, (unsigned long)output_info->input_latencies.count,
+                        output_info->input_latencies.count ?
+                        output_info->input_latencies.sum_ns / 1e6 / output_info->input_latencies.count : 0);
+
+        // Frames in flight on this output won't be presented anymore
+        wl_list_for_each(client_info, &state->clients, link) {
+                if (client_info->latency.output == output_info) {
+                        client_info->latency.output = NULL;
+                        client_info->latency.inflight_ns = 0;
+                }
+        }
+
+        wl_list_remove(&output_info->listener_frame.link);
+        wl_list_remove(&output_info->listener_request_state.link);
+        wl_list_remove(&output_info->listener_present.link);
+        wl_list_remove(&output_info->listener_destroy.link);
+
+        wl_event_source_remove(output_info->render_timer);
+        output_unqueue_render(output_info);
+
+        // Remove output from outputs
+        wl_list_remove(&output_info->link);
+
+        pool_free(&state->pools.outputs, output_info);
+
+        // Clients keep running without outputs (e.g. the monitor was unplugged or
+        // switched away), their toplevels come back when an output shows up
+        if (wl_list_empty(&state->outputs))
+                wlr_log(WLR_INFO, "No outputs left, toplevels are kept until one is added");
+}
+
+// Put the output into the layout (auto_position picks a spot next to the other
+// outputs) and render the scene to it. Moving an output keeps its scene output.
+void output_attach(struct output_info *output_info, bool auto_position, int x, int y)
+{
+        struct state *state = output_info->state;
+        struct wlr_output_layout_output *layout_output;
+
+        if (auto_position)
+                layout_output = wlr_output_layout_add_auto(state->output_layout, output_info->output);
+        else
+                layout_output = wlr_output_layout_add(state->output_layout, output_info->output, x, y);
+        if (!layout_output) {
+                wlr_log(WLR_ERROR, "Failed to add output '%s' to the layout", output_info->output->name);
+                return;
+        }
+
+        // Create wlr_scene_output to handle how the wlr_scene should be rendered on this output
+        if (!output_info->scene_output) {
+                output_info->scene_output = wlr_scene_output_create(state->scene, output_info->output);
+                if (!output_info->scene_output) {
+                        wlr_log(WLR_ERROR, "Failed to create a scene output for '%s'", output_info->output->name);
+                        wlr_output_layout_remove(state->output_layout, output_info->output);
+                        return;
+                }
+                wlr_scene_output_layout_add_output(state->scene_layout, layout_output, output_info->scene_output);
+        }
+
+        layout_adopt_orphans(output_info);
+        layout_mark_dirty(output_info);
+}
+
+// Take a disabled output out of the layout, its toplevels move to the other outputs
+void output_detach(struct output_info *output_info)
+{
+        struct state *state = output_info->state;
+
+        output_release_fullscreen(output_info);
+
+        // Not part of the layout anymore, so it isn't picked as the target
+        wlr_scene_output_destroy(output_info->scene_output);
+        output_info->scene_output = NULL;
+        layout_evacuate(output_info);
+
+        wlr_output_layout_remove(state->output_layout, output_info->output);
+        output_unqueue_render(output_info);
+}
+
+// Tell output management clients about the current configuration
+void handle_output_layout_change(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_output_layout_change);
+        struct wlr_output_configuration_v1 *config;
+        struct wlr_output_configuration_head_v1 *head;
+        struct output_info *output_info;
+        struct wlr_box box;
+
+        config = wlr_output_configuration_v1_create();
+        if (!config)
+                return;
+
+        wl_list_for_each(output_info, &state->outputs, link) {
+                head = wlr_output_configuration_head_v1_create(config, output_info->output);
+                if (!head)
+                        continue;
+
+                wlr_output_layout_get_box(state->output_layout, output_info->output, &box);
+                head->state.enabled = output_info->scene_output != NULL;
+                head->state.x = box.x;
+                head->state.y = box.y;
+        }
+
+        wlr_output_manager_v1_set_configuration(state->output_manager, config);
+}
+
+bool output_manager_apply(struct state *state, struct wlr_output_configuration_v1 *config, bool test_only)
+{
+        struct wlr_backend_output_state *states;
+        struct wlr_output_configuration_head_v1 *head;
+        struct output_info *output_info;
+        size_t states_len, i;
+        bool ok;
+
+        states = wlr_output_configuration_v1_build_state(config, &states_len);
+        if (!states)
+                return false;
+
+        // All outputs are tested and committed together, a configuration the
+        // hardware can't drive as a whole doesn't leave some outputs half changed
+        ok = wlr_backend_test(state->backend, states, states_len);
+        if (ok && !test_only)
+                ok = wlr_backend_commit(state->backend, states, states_len);
+
+        for (i = 0; i < states_len; ++i)
+                wlr_output_state_finish(&states[i].base);
+        free(states);
+
+        if (!ok || test_only)
+                return ok;
+
+        // Enabled outputs first, so the toplevels of the disabled ones have somewhere to go
+        wl_list_for_each(head, &config->heads, link) {
+                output_info = (struct output_info *)head->state.output->data;
+                if (output_info && head->state.enabled) {
+                        output_attach(output_info, false, head->state.x, head->state.y);
+                        output_update_fullscreen(output_info);
+                        // The cursor manager only loads scales it doesn't have yet,
+                        // so this is a no-op unless the scale changed
+                        cursor_theme_load(state, output_info->output->scale);
+                }
+        }
+        wl_list_for_each(head, &config->heads, link) {
+                output_info = (struct output_info *)head->state.output->data;
+                if (output_info && !head->state.enabled && output_info->scene_output)
+                        output_detach(output_info);
+        }
+
+        // Lay out right away instead of on idle, so the next frame already
+        // shows the new configuration
+        layout_flush(state);
+
+        return true;
+}
+
+void handle_output_manager_apply(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_output_manager_apply);
+        struct wlr_output_configuration_v1 *config = (struct wlr_output_configuration_v1 *)data;
+
+        wlr_log(WLR_INFO, "Output configuration apply");
+
+        if (output_manager_apply(state, config, false))
+                wlr_output_configuration_v1_send_succeeded(config);
+        else
+                wlr_output_configuration_v1_send_failed(config);
+        wlr_output_configuration_v1_destroy(config);
+}
+
+void handle_output_manager_test(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_output_manager_test);
+        struct wlr_output_configuration_v1 *config = (struct wlr_output_configuration_v1 *)data;
+
+        if (output_manager_apply(state, config, true))
+                wlr_output_configuration_v1_send_succeeded(config);
+        else
+                wlr_output_configuration_v1_send_failed(config);
+        wlr_output_configuration_v1_destroy(config);
+}
+
+void handle_new_output(struct wl_listener *listener, void *data)
+{
+        // NOTE: wl_container_of is basically a fancy `offsetof`
+        struct state *state = (struct state *)wl_container_of(listener, state, listener_new_output);
+        struct wlr_output *output = (struct wlr_output *)data;
+        struct wlr_output_state output_state;
+        struct wlr_output_mode *output_mode;
+        struct output_info *output_info;
+        bool adaptive_sync, tearing;
+
+        wlr_log(WLR_INFO, "New output");
+
+        // Allocate new custom state for this output
+        output_info = (struct output_info *)pool_alloc(&state->pools.outputs);
+        if (!output_info) {
+                wlr_log(WLR_ERROR, "Out of memory, ignoring output '%s'", output->name);
+                return;
+        }
+
+        output_policy_resolve(state, output->name, &adaptive_sync, &tearing);
+
+        // Configure output to use our renderer and allocator
+        wlr_output_init_render(output, state->allocator, state->renderer);
+
+        // Turn on the output if it's disabled
+        wlr_output_state_init(&output_state);
+        wlr_output_state_set_enabled(&output_state, true);
+
+        // Use output's preferred mode (if it exists and the backend supports it)
+        output_mode = wlr_output_preferred_mode(output);
+        if (output_mode)
+                wlr_output_state_set_mode(&output_state, output_mode);
+
+        // Enable adaptive sync (VRR) if the policy allows it. Outputs can claim
+        // support and still refuse it (e.g. for the chosen mode), so test the
+        // state first and fall back to a fixed refresh rate.
+        if (adaptive_sync && output->adaptive_sync_supported) {
+                wlr_output_state_set_adaptive_sync_enabled(&output_state, true);
+                if (!wlr_output_test_state(output, &output_state)) {
+                        wlr_log(WLR_INFO, "Output '%s' rejected adaptive sync, using a fixed refresh rate", output->name);
+                        wlr_output_state_set_adaptive_sync_enabled(&output_state, false);
+                }
+        }
+
+        // Commit the output state
+        wlr_output_commit_state(output, &output_state);
+        wlr_output_state_finish(&output_state);
+
+        wlr_log(WLR_INFO, "Output '%s': adaptive sync %s, tearing %s", output->name,
+                output->adaptive_sync_status == WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED ? "enabled" : "disabled",
+                tearing ? "allowed" : "disallowed");
+
+        // Load the cursor theme for this output's scale now, instead of
+        // stalling the first time the cursor enters it
+        cursor_theme_load(state, output->scale);
+
+        // The pool hands out zeroed objects, only set what isn't zero
+        output_info->state = state;
+        output_info->output = output;
+        output_info->allow_tearing = tearing;
+        output_info->layout.mode = state->default_layout;
+        wl_list_init(&output_info->layout.toplevels);
+        output->data = output_info;
+        output_info->render_timer = wl_event_loop_add_timer(state->event_loop, handle_output_render_timer, output_info);
+
+        // Setup listeners for new output
+        output_info->listener_frame.notify = handle_output_frame; // render frames
+        wl_signal_add(&output->events.frame, &output_info->listener_frame);
+
+        output_info->listener_request_state.notify = handle_output_request_state; // handles resolution change and other output state requests
+        wl_signal_add(&output->events.request_state, &output_info->listener_request_state);
+
+        output_info->listener_present.notify = handle_output_present; // input latency (-l)
+        wl_signal_add(&output->events.present, &output_info->listener_present);
+
+        output_info->listener_destroy.notify = handle_output_destroy;
+        wl_signal_add(&output->events.destroy, &output_info->listener_destroy);
+
+        // Link this output on the outputs linked list
+        wl_list_insert(&state->outputs, &output_info->link);
+
+        // Add this output to output layout
+        output_attach(output_info, true, 0, 0);
+}
+
+
+int spatial_cell_coord(int value)
+{
+        // Round towards negative infinity, so negative coordinates get their own cells
+        return value >= 0 ? value / SPATIAL_CELL_SIZE : -((-value + SPATIAL_CELL_SIZE - 1) / SPATIAL_CELL_SIZE);
+}
+
+struct spatial_cell **spatial_index_bucket(struct spatial_index *index, int x, int y)
+{
+        uint32_t hash = ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u);
+
+        return &index->buckets[hash & (SPATIAL_BUCKETS - 1)];
+}
+
+struct spatial_cell *spatial_index_find_cell(struct spatial_index *index, int x, int y)
+{
+        struct spatial_cell *cell;
+
+        for (cell = *spatial_index_bucket(index, x, y); cell; cell = cell->next) {
+                if (cell->x == x && cell->y == y)
+                        return cell;
+        }
+
+        return NULL;
+}
+
+bool spatial_cell_append(struct spatial_index *index, int x, int y, struct toplevel_info *toplevel_info)
+{
+        struct spatial_cell **bucket, *cell = spatial_index_find_cell(index, x, y);
+        struct toplevel_info **toplevels;
+        size_t capacity;
+
+        if (!cell) {
+                cell = calloc(1, sizeof(*cell));
+                if (!cell)
+                        return false;
+                bucket = spatial_index_bucket(index, x, y);
+                cell->x = x;
+                cell->y = y;
+                cell->next = *bucket;
+                *bucket = cell;
+        }
+
+        if (cell->len == cell->capacity) {
+                capacity = cell->capacity ? cell->capacity * 2 : 4;
+                toplevels = realloc(cell->toplevels, capacity * sizeof(*toplevels));
+                if (!toplevels)
+                        return false;
+                cell->toplevels = toplevels;
+                cell->capacity = capacity;
+        }
+
+        cell->toplevels[cell->len++] = toplevel_info;
+        return true;
+}
+
+void spatial_cell_remove(struct spatial_index *index, int x, int y, struct toplevel_info *toplevel_info)
+{
+        struct spatial_cell **bucket = spatial_index_bucket(index, x, y), **link, *cell;
+        size_t i;
+
+        for (link = bucket; *link; link = &(*link)->next) {
+                cell = *link;
+                if (cell->x != x || cell->y != y)
+                        continue;
+
+                // Order inside of a cell doesn't matter (stacking is stored in the toplevel)
+                for (i = 0; i < cell->len; ++i) {
+                        if (cell->toplevels[i] == toplevel_info) {
+                                cell->toplevels[i] = cell->toplevels[--cell->len];
+                                break;
+                        }
+                }
+
+                // Free empty cells, otherwise moving windows around would leak them
+                if (cell->len == 0) {
+                        *link = cell->next;
+                        free(cell->toplevels);
+                        free(cell);
+                }
+                return;
+        }
+}
+
+void spatial_index_remove(struct spatial_index *index, struct toplevel_info *toplevel_info)
+{
+        struct wlr_box *box = &toplevel_info->index_box;
+        int x, y;
+
+        if (!toplevel_info->indexed)
+                return;
+        toplevel_info->indexed = false;
+
+        if (wlr_box_empty(box))
+                return;
+
+        for (y = spatial_cell_coord(box->y); y <= spatial_cell_coord(box->y + box->height - 1); ++y) {
+                for (x = spatial_cell_coord(box->x); x <= spatial_cell_coord(box->x + box->width - 1); ++x)
+                        spatial_cell_remove(index, x, y, toplevel_info);
+        }
+}
+
+void spatial_index_insert(struct spatial_index *index, struct toplevel_info *toplevel_info, const struct wlr_box *box)
+{
+        int x, y;
+
+        toplevel_info->index_box = *box;
+        toplevel_info->indexed = true;
+
+        if (wlr_box_empty(box))
+                return;
+
+        for (y = spatial_cell_coord(box->y); y <= spatial_cell_coord(box->y + box->height - 1); ++y) {
+                for (x = spatial_cell_coord(box->x); x <= spatial_cell_coord(box->x + box->width - 1); ++x) {
+                        if (!spatial_cell_append(index, x, y, toplevel_info))
+                                wlr_log(WLR_ERROR, "Failed to grow spatial index, pointer focus may be wrong");
+                }
+        }
+}
+
+void spatial_index_finish(struct spatial_index *index)
+{
+        struct spatial_cell *cell, *next;
+        int i;
+
+        for (i = 0; i < SPATIAL_BUCKETS; ++i) {
+                for (cell = index->buckets[i]; cell; cell = next) {
+                        next = cell->next;
+                        free(cell->toplevels);
+                        free(cell);
+                }
+                index->buckets[i] = NULL;
+        }
+}
+
+void popup_bounds_iterator(struct wlr_surface *surface, int sx, int sy, void *data)
+{
+        struct wlr_box *box = (struct wlr_box *)data;
+        int x2 = box->x + box->width, y2 = box->y + box->height;
+
+        if (sx < box->x)
+                box->x = sx;
+        if (sy < box->y)
+                box->y = sy;
+        if (sx + surface->current.width > x2)
+                x2 = sx + surface->current.width;
+        if (sy + surface->current.height > y2)
+                y2 = sy + surface->current.height;
+
+        box->width = x2 - box->x;
+        box->height = y2 - box->y;
+}
+
+void toplevel_get_bounds(struct toplevel_info *toplevel_info, struct wlr_box *box)
+{
+        // Surface extents include subsurfaces, which can be outside of the main surface,
+        // and popups can be anywhere (they still have to receive pointer input)
+        wlr_surface_get_extends(toplevel_info->xdg_toplevel->base->surface, box);
+        wlr_xdg_surface_for_each_popup_surface(toplevel_info->xdg_toplevel->base, popup_bounds_iterator, box);
+        box->x += toplevel_info->scene_tree->node.x;
+        box->y += toplevel_info->scene_tree->node.y;
+}
+
+void toplevel_update_index(struct toplevel_info *toplevel_info)
+{
+        struct spatial_index *index = &toplevel_info->workspace->spatial_index;
+        struct wlr_box box;
+
+        if (!toplevel_info->xdg_toplevel->base->surface->mapped) {
+                spatial_index_remove(index, toplevel_info);
+                return;
+        }
+
+        toplevel_get_bounds(toplevel_info, &box);
+        if (toplevel_info->indexed && memcmp(&box, &toplevel_info->index_box, sizeof(box)) == 0)
+                return;
+
+        spatial_index_remove(index, toplevel_info);
+        spatial_index_insert(index, toplevel_info, &box);
+}
+
+void toplevel_set_position(struct toplevel_info *toplevel_info, int x, int y)
+{
+        // Toplevels must always be moved through here, so the spatial index stays in sync
+        wlr_scene_node_set_position(&toplevel_info->scene_tree->node, x, y);
+        toplevel_update_index(toplevel_info);
+}
+
+void toplevel_raise(struct toplevel_info *toplevel_info)
+{
+        wlr_scene_node_raise_to_top(&toplevel_info->scene_tree->node);
+        toplevel_info->stacking = ++toplevel_info->state->stacking_counter;
+}
+
+void input_queue_flush(struct state *state)
+{
+        struct wl_client *client, *last_client = NULL;
+        struct wlr_surface *focused;
+        struct queued_input *event;
+        size_t i;
+
+        if (state->input_queue.idle) {
+                wl_event_source_remove(state->input_queue.idle);
+                state->input_queue.idle = NULL;
+        }
+
+        if (state->input_queue.len == 0)
+                return;
+
+        for (i = 0; i < state->input_queue.len; ++i) {
+                event = &state->input_queue.events[i];
+
+                // There is a limitation in the wayland protocol which only allows one keyboard per seat.
+                // Switching it resends the keymap to clients, so only do it when the source
+                // device actually changes.
+                if (wlr_seat_get_keyboard(state->seat) != event->keyboard) {
+                        wlr_seat_set_keyboard(state->seat, event->keyboard);
+                        ++state->input_queue.keyboard_switches;
+                }
+
+                // libwayland writes out what a client was sent once the event loop
+                // iteration is done, so every client in the batch costs one write
+                focused = state->seat->keyboard_state.focused_surface;
+                client = focused ? wl_resource_get_client(focused->resource) : NULL;
+                if (client && client != last_client) {
+                        ++state->input_queue.client_writes;
+                        last_client = client;
+                }
+
+                if (event->is_key) {
+                        latency_note_input(state, state->seat->keyboard_state.focused_surface, event->time_msec);
+                        wlr_seat_keyboard_notify_key(state->seat, event->time_msec, event->keycode, event->key_state);
+                } else
+                        wlr_seat_keyboard_notify_modifiers(state->seat, &event->modifiers);
+        }
+
+        state->input_queue.delivered += state->input_queue.len;
+        ++state->input_queue.batches;
+        state->input_queue.len = 0;
+}
+
+void handle_input_queue_idle(void *data)
+{
+        struct state *state = (struct state *)data;
+
+        // Idle sources are removed after they run
+        state->input_queue.idle = NULL;
+        input_queue_flush(state);
+}
+
+struct queued_input *input_queue_push(struct state *state)
+{
+        if (state->input_queue.len == INPUT_QUEUE_SIZE)
+                input_queue_flush(state);
+
+        // Idle callbacks run once everything else in this event loop iteration
+        // was dispatched, right before libwayland flushes the client buffers
+        if (!state->input_queue.idle)
+                state->input_queue.idle = wl_event_loop_add_idle(state->event_loop, handle_input_queue_idle, state);
+
+        return &state->input_queue.events[state->input_queue.len++];
+}
+
+void focus_toplevel(struct toplevel_info *toplevel_info)
+{
+        struct state *state = toplevel_info->state;
+        struct toplevel_info *previous = state->focused_toplevel;
+        struct wlr_keyboard *keyboard;
+
+        toplevel_raise(toplevel_info);
+
+        // Keep the most recently focused toplevels at the front, for focus cycling
+        wl_list_remove(&toplevel_info->link);
+        wl_list_insert(&toplevel_info->workspace->toplevels, &toplevel_info->link);
+
+        // Toplevels on hidden workspaces get focus once their workspace is shown
+        if (previous == toplevel_info || toplevel_info->workspace != state->workspace)
+                return;
+
+        // Deliver the queued keys to the client that had focus when they were pressed
+        input_queue_flush(state);
+
+        if (previous)
+                wlr_xdg_toplevel_set_activated(previous->xdg_toplevel, false);
+        wlr_xdg_toplevel_set_activated(toplevel_info->xdg_toplevel, true);
+        state->focused_toplevel = toplevel_info;
+
+        // Move keyboard focus to window
+        keyboard = wlr_seat_get_keyboard(state->seat);
+        if (keyboard != NULL) {
+                wlr_seat_keyboard_notify_enter(state->seat, toplevel_info->xdg_toplevel->base->surface,
+                        keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+        }
+}
+
+void focus_next_mapped(struct state *state, struct toplevel_info *except)
+{
+        struct toplevel_info *toplevel_info;
+
+        wl_list_for_each(toplevel_info, &state->workspace->toplevels, link) {
+                if (toplevel_info != except && toplevel_info->xdg_toplevel->base->surface->mapped) {
+                        focus_toplevel(toplevel_info);
+                        return;
+                }
+        }
+
+        input_queue_flush(state);
+        state->focused_toplevel = NULL;
+        wlr_seat_keyboard_notify_clear_focus(state->seat);
+}
+
+bool toplevel_is_above(struct toplevel_info *a, struct toplevel_info *b)
+{
+        // Fullscreen toplevels live in a layer above all regular ones
+        if ((a->fullscreen_output != NULL) != (b->fullscreen_output != NULL))
+                return a->fullscreen_output != NULL;
+        return a->stacking > b->stacking;
+}
+
+struct toplevel_info *toplevel_at(struct state *state, double lx, double ly,
+                                  struct wlr_surface **surface, double *sx, double *sy)
+{
+        struct spatial_cell *cell;
+        struct toplevel_info *toplevel_info, *found = NULL;
+        struct wlr_surface *hit;
+        double hit_sx, hit_sy;
+        size_t i;
+
+        *surface = NULL;
+
+        // Each workspace has its own index, so hidden toplevels are never looked at
+        cell = spatial_index_find_cell(&state->workspace->spatial_index,
+                                       spatial_cell_coord((int)floor(lx)), spatial_cell_coord((int)floor(ly)));
+        if (!cell)
+                return NULL;
+
+        // Only the toplevels overlapping this cell can be under the cursor,
+        // pick the topmost one that actually has an input surface there
+        for (i = 0; i < cell->len; ++i) {
+                toplevel_info = cell->toplevels[i];
+                if (found && !toplevel_is_above(toplevel_info, found))
+                        continue;
+                // Waiting for a transaction, not on screen yet
+                if (!toplevel_info->scene_tree->node.enabled && !toplevel_info->snapshot)
+                        continue;
+                if (!wlr_box_contains_point(&toplevel_info->index_box, lx, ly))
+                        continue;
+
+                hit = wlr_xdg_surface_surface_at(toplevel_info->xdg_toplevel->base,
+                                                 lx - toplevel_info->scene_tree->node.x,
+                                                 ly - toplevel_info->scene_tree->node.y,
+                                                 &hit_sx, &hit_sy);
+                if (!hit)
+                        continue;
+
+                found = toplevel_info;
+                *surface = hit;
+                *sx = hit_sx;
+                *sy = hit_sy;
+        }
+
+        return found;
+}
+
+// Layout
+// Every output is a container for the toplevels placed on it. Changes (map,
+// unmap, output resize, ...) only mark the affected container dirty, the
+// dirty containers are laid out together once the event loop iteration is
+// done. Toplevels that already have the right size aren't configured again.
+struct output_info *output_at_cursor(struct state *state)
+{
+        struct wlr_output *output;
+        struct output_info *first;
+
+        output = wlr_output_layout_output_at(state->output_layout, state->cursor->x, state->cursor->y);
+        if (output && output->data)
+                return (struct output_info *)output->data;
+
+        // Disabled outputs can't take toplevels
+        wl_list_for_each(first, &state->outputs, link) {
+                if (first->scene_output)
+                        return first;
+        }
+        return NULL;
+}
+
+struct wlr_scene_tree *toplevel_layer(struct toplevel_info *toplevel_info)
+{
+        return toplevel_info->floating ? toplevel_info->workspace->layer_floating : toplevel_info->workspace->layer_normal;
+}
+
+bool toplevel_is_floating(struct toplevel_info *toplevel_info)
+{
+        // Unmapped and orphaned toplevels have no container
+        return toplevel_info->floating ||
+               (toplevel_info->container && toplevel_info->container->layout.mode == LAYOUT_FLOATING);
+}
+
+void handle_layout_idle(void *data)
+{
+        struct state *state = (struct state *)data;
+
+        // The idle source is destroyed after this callback returns
+        state->layout_idle = NULL;
+        layout_flush(state);
+}
+
+void layout_mark_dirty(struct output_info *output_info)
+{
+        struct state *state = output_info->state;
+
+        output_info->layout.dirty = true;
+        if (!state->layout_idle)
+                state->layout_idle = wl_event_loop_add_idle(state->event_loop, handle_layout_idle, state);
+}
+
+// Transactions
+// Resizing a tiled toplevel moves its neighbours as well. Applying every client
+// commit as it arrives would show the intermediate states (overlapping or gaping
+// windows), so the old content of the resized toplevels stays on screen until
+// all of them committed their new size, or the timeout is over. Then every
+// move is applied at once, in a single frame.
+void snapshot_buffer_iterator(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+        struct wlr_scene_tree *snapshot = (struct wlr_scene_tree *)data;
+        struct wlr_scene_buffer *copy;
+
+        if (!buffer->buffer)
+                return;
+
+        // The copy holds a reference to the buffer, the client can't reuse it meanwhile
+        copy = wlr_scene_buffer_create(snapshot, buffer->buffer);
+        if (!copy)
+                return;
+        wlr_scene_node_set_position(&copy->node, sx, sy);
+        wlr_scene_buffer_set_dest_size(copy, buffer->dst_width, buffer->dst_height);
+        wlr_scene_buffer_set_source_box(copy, &buffer->src_box);
+        wlr_scene_buffer_set_transform(copy, buffer->transform);
+        wlr_scene_buffer_set_opacity(copy, buffer->opacity);
+}
+
+void toplevel_snapshot(struct toplevel_info *toplevel_info)
+{
+        struct wlr_scene_node *node = &toplevel_info->scene_tree->node;
+
+        // Buffer positions are relative to the parent of the toplevel tree
+        toplevel_info->snapshot = wlr_scene_tree_create(node->parent);
+        if (!toplevel_info->snapshot)
+                return;
+        wlr_scene_node_place_above(&toplevel_info->snapshot->node, node);
+        wlr_scene_node_for_each_buffer(node, snapshot_buffer_iterator, toplevel_info->snapshot);
+        wlr_scene_node_set_enabled(node, false);
+}
+
+void toplevel_drop_snapshot(struct toplevel_info *toplevel_info)
+{
+        if (!toplevel_info->snapshot)
+                return;
+
+        wlr_scene_node_destroy(&toplevel_info->snapshot->node);
+        toplevel_info->snapshot = NULL;
+        wlr_scene_node_set_enabled(&toplevel_info->scene_tree->node, true);
+}
+
+void transaction_apply(struct state *state, bool timed_out)
+{
+        struct toplevel_info *toplevel_info, *tmp;
+        struct wlr_box geometry;
+        int64_t elapsed;
+
+        if (!state->transaction.active)
+                return;
+
+        // The timer is gone when the toplevels are destroyed on shutdown
+        if (state->transaction.timer)
+                wl_event_source_timer_update(state->transaction.timer, 0);
+
+        wl_list_for_each_safe(toplevel_info, tmp, &state->transaction.toplevels, transaction_link) {
+                wlr_xdg_surface_get_geometry(toplevel_info->xdg_toplevel->base, &geometry);
+                toplevel_set_position(toplevel_info, toplevel_info->transaction_box.x - geometry.x,
+                                      toplevel_info->transaction_box.y - geometry.y);
+                toplevel_drop_snapshot(toplevel_info);
+                wlr_scene_node_set_enabled(&toplevel_info->scene_tree->node, true);
+
+                wl_list_remove(&toplevel_info->transaction_link);
+                toplevel_info->in_transaction = false;
+                toplevel_info->transaction_waiting = false;
+        }
+
+        elapsed = now_ns() - state->transaction.start_ns;
+        histogram_add(&state->transaction.times, elapsed);
+        TRACE(TRACE_TRANSACTION, timed_out, elapsed);
+
+        state->transaction.active = false;
+        state->transaction.waiting = 0;
+        ++state->transaction.applied;
+        if (timed_out)
+                ++state->transaction.timed_out;
+}
+
+int handle_transaction_timer(void *data)
+{
+        struct state *state = (struct state *)data;
+
+        // Slow clients show their old content at the new position until they catch up
+        transaction_apply(state, true);
+
+        return 0;
+}
+
+// Move the toplevel to box once the transaction is applied. A serial means
+// the toplevel was resized, the transaction waits for it to commit that configure.
+void transaction_add(struct toplevel_info *toplevel_info, const struct wlr_box *box, uint32_t serial)
+{
+        struct state *state = toplevel_info->state;
+
+        if (!state->transaction.active) {
+                state->transaction.active = true;
+                state->transaction.start_ns = now_ns();
+                wl_event_source_timer_update(state->transaction.timer, state->transaction.timeout_ms);
+        }
+
+        // Changes while the transaction is in flight are merged into it, the
+        // deadline stays the same so the transaction can't be held off forever
+        if (!toplevel_info->in_transaction) {
+                toplevel_info->in_transaction = true;
+                wl_list_insert(state->transaction.toplevels.prev, &toplevel_info->transaction_link);
+        }
+        toplevel_info->transaction_box = *box;
+
+        if (serial) {
+                toplevel_info->transaction_serial = serial;
+                if (!toplevel_info->transaction_waiting) {
+                        toplevel_info->transaction_waiting = true;
+                        ++state->transaction.waiting;
+                }
+                // New toplevels have nothing to show yet, they stay hidden instead
+                if (!toplevel_info->snapshot && toplevel_info->xdg_toplevel->base->surface->mapped)
+                        toplevel_snapshot(toplevel_info);
+        }
+}
+
+void transaction_remove(struct toplevel_info *toplevel_info)
+{
+        struct state *state = toplevel_info->state;
+
+        if (!toplevel_info->in_transaction)
+                return;
+
+        toplevel_drop_snapshot(toplevel_info);
+        wlr_scene_node_set_enabled(&toplevel_info->scene_tree->node, true);
+        wl_list_remove(&toplevel_info->transaction_link);
+        toplevel_info->in_transaction = false;
+        if (toplevel_info->transaction_waiting) {
+                toplevel_info->transaction_waiting = false;
+                if (--state->transaction.waiting == 0)
+                        transaction_apply(state, false);
+        }
+}
+
+// Called on every commit of a toplevel that is part of the transaction
+void transaction_handle_commit(struct toplevel_info *toplevel_info)
+{
+        struct state *state = toplevel_info->state;
+        uint32_t serial = toplevel_info->xdg_toplevel->base->current.configure_serial;
+
+        // The serial may be for a later configure (serials wrap around). New
+        // toplevels are only ready once they're mapped, with a buffer to show.
+        if (!toplevel_info->transaction_waiting || (int32_t)(serial - toplevel_info->transaction_serial) < 0 ||
+            !toplevel_info->xdg_toplevel->base->surface->mapped)
+                return;
+
+        toplevel_info->transaction_waiting = false;
+        if (--state->transaction.waiting == 0)
+                transaction_apply(state, false);
+}
+
+void toplevel_configure_box(struct toplevel_info *toplevel_info, const struct wlr_box *box)
+{
+        struct wlr_xdg_toplevel *xdg_toplevel = toplevel_info->xdg_toplevel;
+        struct state *state = toplevel_info->state;
+        struct wlr_box geometry;
+        uint32_t serial = 0;
+        bool moved;
+
+        if (toplevel_info->configure_pending || xdg_toplevel->scheduled.width != box->width ||
+            xdg_toplevel->scheduled.height != box->height) {
+                serial = wlr_xdg_toplevel_set_size(xdg_toplevel, box->width, box->height);
+                toplevel_info->configure_pending = false;
+                ++state->configures_sent;
+        } else {
+                ++state->configures_skipped;
+        }
+
+        wlr_xdg_surface_get_geometry(xdg_toplevel->base, &geometry);
+        moved = toplevel_info->scene_tree->node.x != box->x - geometry.x ||
+                toplevel_info->scene_tree->node.y != box->y - geometry.y;
+
+        // Hidden toplevels aren't on screen, there's nothing to keep consistent
+        if (toplevel_info->workspace != state->workspace) {
+                transaction_remove(toplevel_info);
+                if (moved)
+                        toplevel_set_position(toplevel_info, box->x - geometry.x, box->y - geometry.y);
+                return;
+        }
+
+        // Not on screen yet, but a new toplevel still waits for the transaction,
+        // so it shows up together with the neighbours making room for it
+        // (it's kept hidden once mapped, see handle_xdg_toplevel_map)
+        if (!xdg_toplevel->base->surface->mapped) {
+                if (moved)
+                        toplevel_set_position(toplevel_info, box->x - geometry.x, box->y - geometry.y);
+                if (serial || toplevel_info->in_transaction)
+                        transaction_add(toplevel_info, box, serial);
+                return;
+        }
+
+        if (serial || moved || toplevel_info->in_transaction)
+                transaction_add(toplevel_info, box, serial);
+}
+
+void toplevel_place_floating(struct toplevel_info *toplevel_info)
+{
+        struct wlr_box output_box, geometry;
+
+        // Center it on its output, with the size the client picked
+        wlr_output_layout_get_box(toplevel_info->state->output_layout, toplevel_info->container->output, &output_box);
+        wlr_xdg_surface_get_geometry(toplevel_info->xdg_toplevel->base, &geometry);
+        toplevel_set_position(toplevel_info, output_box.x + (output_box.width - geometry.width) / 2 - geometry.x,
+                              output_box.y + (output_box.height - geometry.height) / 2 - geometry.y);
+        toplevel_info->placed = true;
+}
+
+void layout_arrange(struct output_info *output_info)
+{
+        struct state *state = output_info->state;
+        struct toplevel_info *toplevel_info;
+        struct wlr_box output_box, box;
+        int tiled[WORKSPACE_COUNT] = { 0 }, index[WORKSPACE_COUNT] = { 0 }, stack_y[WORKSPACE_COUNT];
+        int master_width, n;
+
+        output_info->layout.dirty = false;
+        ++state->layout_runs;
+
+        wlr_output_layout_get_box(state->output_layout, output_info->output, &output_box);
+        if (wlr_box_empty(&output_box))
+                return;
+
+        // The container holds the toplevels of every workspace, each workspace
+        // is laid out on its own
+        wl_list_for_each(toplevel_info, &output_info->layout.toplevels, container_link) {
+                if (!toplevel_is_floating(toplevel_info) && !toplevel_info->fullscreen_output)
+                        ++tiled[toplevel_info->workspace->index];
+        }
+
+        for (n = 0; n < WORKSPACE_COUNT; ++n)
+                stack_y[n] = output_box.y;
+
+        wl_list_for_each(toplevel_info, &output_info->layout.toplevels, container_link) {
+                // Fullscreen toplevels get their place back when they leave fullscreen
+                if (toplevel_info->fullscreen_output)
+                        continue;
+
+                if (toplevel_is_floating(toplevel_info)) {
+                        // Let the client pick its size, it's centered once mapped
+                        if (toplevel_info->configure_pending) {
+                                wlr_xdg_toplevel_set_size(toplevel_info->xdg_toplevel, 0, 0);
+                                toplevel_info->configure_pending = false;
+                                ++state->configures_sent;
+                        }
+                        continue;
+                }
+
+                n = toplevel_info->workspace->index;
+                box = output_box;
+                if (output_info->layout.mode == LAYOUT_TILING && tiled[n] > 1) {
+                        master_width = (int)(output_box.width * state->master_ratio);
+                        if (index[n] == 0) {
+                                box.width = master_width;
+                        } else {
+                                box.x += master_width;
+                                box.width -= master_width;
+                                box.y = stack_y[n];
+                                // The last toplevel of the stack takes the rounding error
+                                box.height = index[n] == tiled[n] - 1 ? output_box.y + output_box.height - stack_y[n]
+                                                                      : output_box.height / (tiled[n] - 1);
+                                stack_y[n] += box.height;
+                        }
+                }
+
+                toplevel_configure_box(toplevel_info, &box);
+                ++index[n];
+        }
+}
+
+void layout_flush(struct state *state)
+{
+        struct output_info *output_info;
+
+        if (state->layout_idle) {
+                wl_event_source_remove(state->layout_idle);
+                state->layout_idle = NULL;
+        }
+
+        wl_list_for_each(output_info, &state->outputs, link) {
+                if (output_info->layout.dirty)
+                        layout_arrange(output_info);
+        }
+
+        // Only moves, nothing to wait for
+        if (state->transaction.active && state->transaction.waiting == 0)
+                transaction_apply(state, false);
+}
+
+void layout_add(struct toplevel_info *toplevel_info, struct output_info *output_info)
+{
+        toplevel_info->container = output_info;
+        wl_list_insert(output_info->layout.toplevels.prev, &toplevel_info->container_link);
+        layout_mark_dirty(output_info);
+}
+
+void layout_remove(struct toplevel_info *toplevel_info)
+{
+        if (!toplevel_info->container)
+                return;
+
+        wl_list_remove(&toplevel_info->container_link);
+        layout_mark_dirty(toplevel_info->container);
+        toplevel_info->container = NULL;
+        toplevel_info->placed = false;
+}
+
+// Add a toplevel that comes from another (or no) output, floating ones get centered
+void layout_move(struct toplevel_info *toplevel_info, struct output_info *target)
+{
+        layout_add(toplevel_info, target);
+        if (toplevel_is_floating(toplevel_info) && toplevel_info->xdg_toplevel->base->surface->mapped)
+                toplevel_place_floating(toplevel_info);
+}
+
+// Without another output the toplevels are orphaned, until layout_adopt_orphans
+void layout_evacuate(struct output_info *output_info)
+{
+        struct output_info *target = NULL, *other;
+        struct toplevel_info *toplevel_info, *tmp;
+
+        wl_list_for_each(other, &output_info->state->outputs, link) {
+                if (other != output_info && other->scene_output) {
+                        target = other;
+                        break;
+                }
+        }
+
+        wl_list_for_each_safe(toplevel_info, tmp, &output_info->layout.toplevels, container_link) {
+                wl_list_remove(&toplevel_info->container_link);
+                toplevel_info->container = NULL;
+                if (target)
+                        layout_move(toplevel_info, target);
+        }
+}
+
+void layout_adopt_orphans(struct output_info *output_info)
+{
+        struct state *state = output_info->state;
+        struct toplevel_info *toplevel_info;
+        struct workspace *workspace;
+
+        for (workspace = state->workspaces; workspace < state->workspaces + WORKSPACE_COUNT; ++workspace) {
+                wl_list_for_each(toplevel_info, &workspace->toplevels, link) {
+                        // Toplevels before their initial commit are added by the commit handler
+                        if (!toplevel_info->container && toplevel_info->xdg_toplevel->base->initialized)
+                                layout_move(toplevel_info, output_info);
+                }
+        }
+}
+
+void layout_set_mode(struct output_info *output_info, enum layout_mode mode)
+{
+        struct toplevel_info *toplevel_info;
+
+        if (output_info->layout.mode == mode)
+                return;
+
+        output_info->layout.mode = mode;
+        layout_mark_dirty(output_info);
+
+        // Toplevels that just started floating get centered, like new ones
+        if (mode == LAYOUT_FLOATING) {
+                wl_list_for_each(toplevel_info, &output_info->layout.toplevels, container_link) {
+                        if (!toplevel_info->placed && toplevel_info->xdg_toplevel->base->surface->mapped &&
+                            !toplevel_info->fullscreen_output)
+                                toplevel_place_floating(toplevel_info);
+                }
+        }
+}
+
+void toplevel_toggle_floating(struct toplevel_info *toplevel_info)
+{
+        toplevel_info->floating = !toplevel_info->floating;
+        if (!toplevel_info->fullscreen_output)
+                wlr_scene_node_reparent(&toplevel_info->scene_tree->node, toplevel_layer(toplevel_info));
+
+        if (!toplevel_info->container)
+                return;
+
+        layout_mark_dirty(toplevel_info->container);
+        if (toplevel_info->floating && !toplevel_info->placed && !toplevel_info->fullscreen_output)
+                toplevel_place_floating(toplevel_info);
+}
+
+void cursor_image_reset(struct state *state)
+{
+        if (state->cursor_image.type == CURSOR_IMAGE_SURFACE)
+                wl_list_remove(&state->cursor_image.listener_surface_destroy.link);
+
+        state->cursor_image.type = CURSOR_IMAGE_NONE;
+        state->cursor_image.xcursor_name = NULL;
+        state->cursor_image.surface = NULL;
+}
+
+void handle_cursor_surface_destroy(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, cursor_image.listener_surface_destroy);
+
+        // wlr_cursor drops the surface by itself, we just need to forget it so
+        // the next image change isn't mistaken for a no-op
+        cursor_image_reset(state);
+}
+
+// Loading a theme reads every cursor image of its size, so nothing is loaded
+// before the first frame is out (see handle_startup_idle)
+void cursor_theme_load(struct state *state, float scale)
+{
+        if (state->startup.deferred_done)
+                wlr_xcursor_manager_load(state->xcursor_manager, scale);
+}
+
+void cursor_set_xcursor(struct state *state, const char *name)
+{
+        if (state->cursor_image.type == CURSOR_IMAGE_XCURSOR && strcmp(state->cursor_image.xcursor_name, name) == 0)
+                return;
+
+        cursor_image_reset(state);
+        state->cursor_image.type = CURSOR_IMAGE_XCURSOR;
+        state->cursor_image.xcursor_name = name;
+        wlr_cursor_set_xcursor(state->cursor, state->xcursor_manager, name);
+}
+
+void cursor_set_surface(struct state *state, struct wlr_surface *surface, int32_t hotspot_x, int32_t hotspot_y)
+{
+        // A client setting a NULL surface wants the cursor hidden
+        if (!surface) {
+                if (state->cursor_image.type == CURSOR_IMAGE_HIDDEN)
+                        return;
+
+                cursor_image_reset(state);
+                state->cursor_image.type = CURSOR_IMAGE_HIDDEN;
+                wlr_cursor_unset_image(state->cursor);
+                return;
+        }
+
+        if (state->cursor_image.type == CURSOR_IMAGE_SURFACE && state->cursor_image.surface == surface &&
+            state->cursor_image.hotspot_x == hotspot_x && state->cursor_image.hotspot_y == hotspot_y)
+                return;
+
+        cursor_image_reset(state);
+        state->cursor_image.type = CURSOR_IMAGE_SURFACE;
+        state->cursor_image.surface = surface;
+        state->cursor_image.hotspot_x = hotspot_x;
+        state->cursor_image.hotspot_y = hotspot_y;
+        state->cursor_image.listener_surface_destroy.notify = handle_cursor_surface_destroy;
+        wl_signal_add(&surface->events.destroy, &state->cursor_image.listener_surface_destroy);
+        wlr_cursor_set_surface(state->cursor, surface, hotspot_x, hotspot_y);
+}
+
+void process_cursor_motion(struct state *state, uint32_t time_msec)
+{
+        struct wlr_surface *surface;
+        double sx, sy;
+
+        if (state->seat->drag)
+                wlr_scene_node_set_position(&state->layer_drag_icon->node, (int)state->cursor->x, (int)state->cursor->y);
+
+        toplevel_at(state, state->cursor->x, state->cursor->y, &surface, &sx, &sy);
+
+        // No client under the cursor, so the compositor owns the cursor image
+        if (!surface) {
+                cursor_set_xcursor(state, "default");
+                wlr_seat_pointer_clear_focus(state->seat);
+                return;
+        }
+
+        // Entering a surface that already has focus is a no-op, so this only
+        // sends an enter event when the pointer actually crosses surfaces
+        wlr_seat_pointer_notify_enter(state->seat, surface, sx, sy);
+        wlr_seat_pointer_notify_motion(state->seat, time_msec, sx, sy);
+        latency_note_input(state, surface, time_msec);
+}
+
+void send_relative_motion(struct state *state, uint32_t time_msec, double dx, double dy, double unaccel_dx, double unaccel_dy)
+{
+        // Clients like games use the relative pointer protocol to get raw deltas
+        wlr_relative_pointer_manager_v1_send_relative_motion(state->relative_pointer_manager, state->seat,
+                                                             (uint64_t)time_msec * 1000, dx, dy, unaccel_dx, unaccel_dy);
+}
+
+void flush_pending_motion(struct state *state)
+{
+        struct wlr_input_device *device = state->pending_motion.device;
+
+        if (!state->pending_motion.pending)
+                return;
+
+        if (state->pending_motion.absolute)
+                wlr_cursor_warp_absolute(state->cursor, device, state->pending_motion.x, state->pending_motion.y);
+        if (state->pending_motion.dx != 0 || state->pending_motion.dy != 0)
+                wlr_cursor_move(state->cursor, device, state->pending_motion.dx, state->pending_motion.dy);
+        if (state->pending_motion.unaccel_dx != 0 || state->pending_motion.unaccel_dy != 0 ||
+            state->pending_motion.dx != 0 || state->pending_motion.dy != 0) {
+                send_relative_motion(state, state->pending_motion.time_msec,
+                                     state->pending_motion.dx, state->pending_motion.dy,
+                                     state->pending_motion.unaccel_dx, state->pending_motion.unaccel_dy);
+        }
+
+        // Focus lookup and client notification only happen once for the whole batch
+        process_cursor_motion(state, state->pending_motion.time_msec);
+
+        memset(&state->pending_motion, 0, sizeof(state->pending_motion));
+}
+
+void queue_pending_motion(struct state *state, struct wlr_input_device *device, uint32_t time_msec)
+{
+        // Events from different devices are not merged, since they can be
+        // constrained differently (e.g. mapped to different outputs)
+        if (state->pending_motion.pending && state->pending_motion.device != device)
+                flush_pending_motion(state);
+
+        state->pending_motion.pending = true;
+        state->pending_motion.device = device;
+        state->pending_motion.time_msec = time_msec;
+}
+
+void handle_cursor_motion(struct wl_listener *listener, void *data)
+{
+        // This event triggers when we have a relative mouse motion (delta)
+        struct state *state = (struct state *)wl_container_of(listener, state, listener_cursor_motion);
+	struct wlr_pointer_motion_event *event = (struct wlr_pointer_motion_event *)data;
+
+        TRACE(TRACE_CURSOR_MOTION, 0, 0);
+        device_count_event(&event->pointer->base, event->time_msec);
+
+        if (state->coalesce_motion) {
+                queue_pending_motion(state, &event->pointer->base, event->time_msec);
+                state->pending_motion.dx += event->delta_x;
+                state->pending_motion.dy += event->delta_y;
+                state->pending_motion.unaccel_dx += event->unaccel_dx;
+                state->pending_motion.unaccel_dy += event->unaccel_dy;
+                return;
+        }
+
+        wlr_cursor_move(state->cursor, &event->pointer->base, event->delta_x, event->delta_y);
+        send_relative_motion(state, event->time_msec, event->delta_x, event->delta_y, event->unaccel_dx, event->unaccel_dy);
+        process_cursor_motion(state, event->time_msec);
+}
+
+void handle_cursor_motion_absolute(struct wl_listener *listener, void *data)
+{
+        // This event triggers when we have an absolute mouse motion, which
+        // can happen in things like running the compositor inside another
+        // Wayland compositor (which can set the mouse absolute position)
+        struct state *state = wl_container_of(listener, state, listener_cursor_motion_absolute);
+	struct wlr_pointer_motion_absolute_event *event = (struct wlr_pointer_motion_absolute_event *)data;
+
+        TRACE(TRACE_CURSOR_MOTION_ABSOLUTE, 0, 0);
+        device_count_event(&event->pointer->base, event->time_msec);
+
+        if (state->coalesce_motion) {
+                // An absolute position makes the relative motion before it irrelevant
+                // for the cursor position (but not for the raw deltas)
+                queue_pending_motion(state, &event->pointer->base, event->time_msec);
+                state->pending_motion.absolute = true;
+                state->pending_motion.x = event->x;
+                state->pending_motion.y = event->y;
+                state->pending_motion.dx = 0;
+                state->pending_motion.dy = 0;
+                return;
+        }
+
+	wlr_cursor_warp_absolute(state->cursor, &event->pointer->base, event->x, event->y);
+        process_cursor_motion(state, event->time_msec);
+}
+
+void flush_pending_axis(struct state *state)
+{
+        int orientation;
+
+        for (orientation = 0; orientation < 2; ++orientation) {
+                if (!state->pending_axis[orientation].pending)
+                        continue;
+
+                latency_note_input(state, state->seat->pointer_state.focused_surface,
+                                   state->pending_axis[orientation].time_msec);
+                wlr_seat_pointer_notify_axis(state->seat, state->pending_axis[orientation].time_msec,
+                                             (enum wl_pointer_axis)orientation, state->pending_axis[orientation].delta,
+                                             state->pending_axis[orientation].delta_discrete,
+                                             state->pending_axis[orientation].source,
+                                             state->pending_axis[orientation].relative_direction);
+                state->pending_axis[orientation].pending = false;
+                ++state->axis_sent;
+        }
+}
+
+void handle_cursor_button(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_cursor_button);
+        struct wlr_pointer_button_event *event = (struct wlr_pointer_button_event *)data;
+        struct toplevel_info *toplevel_info;
+        struct wlr_surface *surface;
+        double sx, sy;
+
+        TRACE(TRACE_CURSOR_BUTTON, event->button, event->state);
+        device_count_event(&event->pointer->base, event->time_msec);
+
+        // Whatever happened earlier in this frame happened before the click
+        flush_pending_motion(state);
+        flush_pending_axis(state);
+
+        // Click to focus. Raising only moves the toplevel to the top of its
+        // layer, the rest of the scene keeps its order. Another button pressed
+        // during a drag doesn't raise what's under the dragged icon.
+        if (event->state == WL_POINTER_BUTTON_STATE_PRESSED && !state->seat->drag) {
+                toplevel_info = toplevel_at(state, state->cursor->x, state->cursor->y, &surface, &sx, &sy);
+                if (toplevel_info)
+                        focus_toplevel(toplevel_info);
+        }
+
+        // The press gives the client the grab serial it needs to start a drag,
+        // the release goes to the drag grab and drops (see handle_request_start_drag)
+        latency_note_input(state, state->seat->pointer_state.focused_surface, event->time_msec);
+        wlr_seat_pointer_notify_button(state->seat, event->time_msec, event->button, event->state);
+}
+
+// Touchpads send many small axis events per frame. They're merged per
+// orientation and sent once, right before the frame event.
+void queue_axis(struct state *state, const struct wlr_pointer_axis_event *event)
+{
+        int orientation = event->orientation == WL_POINTER_AXIS_HORIZONTAL_SCROLL ? 1 : 0;
+
+        // Events only add up if they mean the same thing
+        if (state->pending_axis[orientation].pending &&
+            (state->pending_axis[orientation].source != event->source ||
+             state->pending_axis[orientation].relative_direction != event->relative_direction))
+                flush_pending_axis(state);
+
+        if (!state->pending_axis[orientation].pending) {
+                state->pending_axis[orientation].pending = true;
+                state->pending_axis[orientation].source = event->source;
+                state->pending_axis[orientation].relative_direction = event->relative_direction;
+                state->pending_axis[orientation].delta = 0;
+                state->pending_axis[orientation].delta_discrete = 0;
+        }
+
+        state->pending_axis[orientation].time_msec = event->time_msec;
+        state->pending_axis[orientation].delta += event->delta;
+        state->pending_axis[orientation].delta_discrete += event->delta_discrete;
+}
+
+void handle_cursor_axis(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_cursor_axis);
+        struct wlr_pointer_axis_event *event = (struct wlr_pointer_axis_event *)data;
+
+        TRACE(TRACE_CURSOR_AXIS, 0, 0);
+        device_count_event(&event->pointer->base, event->time_msec);
+        ++state->axis_events;
+
+        // A zero delta is the end of a finger scroll (axis_stop for kinetic
+        // scrolling), it must not vanish in the sum
+        if (event->delta == 0 && event->delta_discrete == 0) {
+                flush_pending_axis(state);
+                wlr_seat_pointer_notify_axis(state->seat, event->time_msec, event->orientation, 0, 0,
+                                             event->source, event->relative_direction);
+                ++state->axis_sent;
+                return;
+        }
+
+        flush_pending_motion(state);
+        queue_axis(state, event);
+}
+
+void handle_cursor_frame(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_cursor_frame);
+
+        TRACE(TRACE_CURSOR_FRAME, 0, 0);
+
+        flush_pending_motion(state);
+        flush_pending_axis(state);
+
+        // Notify focused client of the mouse frame event
+        wlr_seat_pointer_notify_frame(state->seat);
+}
+
+void handle_keyboard_modifiers(struct wl_listener *listener, void *data)
+{
+        struct keyboard_info *keyboard_info = wl_container_of(listener, keyboard_info, listener_modifiers);
+        struct queued_input *event;
+
+        TRACE(TRACE_KEYBOARD_MODIFIERS, 0, 0);
+
+        event = input_queue_push(keyboard_info->state);
+        event->is_key = false;
+        event->keyboard = keyboard_info->keyboard;
+        event->modifiers = keyboard_info->keyboard->modifiers;
+}
+
+uint32_t keybinding_hash(uint32_t modifiers, xkb_keysym_t keysym)
+{
+        return (keysym * 2654435761u) ^ (modifiers * 40503u);
+}
+
+struct keybinding *keybindings_find(struct keybindings *keybindings, uint32_t modifiers, xkb_keysym_t keysym)
+{
+        size_t mask = keybindings->capacity - 1, i;
+        struct keybinding *entry;
+
+        if (keybindings->capacity == 0)
+                return NULL;
+
+        for (i = keybinding_hash(modifiers, keysym) & mask;; i = (i + 1) & mask) {
+                entry = &keybindings->entries[i];
+                if (entry->keysym == XKB_KEY_NoSymbol)
+                        return NULL;
+                if (entry->keysym == keysym && entry->modifiers == modifiers)
+                        return entry;
+        }
+}
+
+bool keybindings_grow(struct keybindings *keybindings)
+{
+        struct keybinding *old = keybindings->entries, *entry;
+        size_t old_capacity = keybindings->capacity, capacity, mask, i, j;
+
+        capacity = old_capacity ? old_capacity * 2 : 64;
+        keybindings->entries = calloc(capacity, sizeof(*keybindings->entries));
+        if (!keybindings->entries) {
+                keybindings->entries = old;
+                return false;
+        }
+        keybindings->capacity = capacity;
+        mask = capacity - 1;
+
+        for (i = 0; i < old_capacity; ++i) {
+                if (old[i].keysym == XKB_KEY_NoSymbol)
+                        continue;
+                for (j = keybinding_hash(old[i].modifiers, old[i].keysym) & mask;; j = (j + 1) & mask) {
+                        entry = &keybindings->entries[j];
+                        if (entry->keysym == XKB_KEY_NoSymbol) {
+                                *entry = old[i];
+                                break;
+                        }
+                }
+        }
+
+        free(old);
+        return true;
+}
+
+bool keybindings_add(struct keybindings *keybindings, const struct keybinding *binding)
+{
+        struct keybinding *entry;
+        size_t mask, i;
+
+        // Rebinding a key replaces the previous binding
+        entry = keybindings_find(keybindings, binding->modifiers, binding->keysym);
+        if (entry) {
+                free(entry->command);
+                *entry = *binding;
+                return true;
+        }
+
+        // Keep the load factor below 3/4 so probe sequences stay short
+        if ((keybindings->len + 1) * 4 > keybindings->capacity * 3 && !keybindings_grow(keybindings))
+                return false;
+
+        mask = keybindings->capacity - 1;
+        for (i = keybinding_hash(binding->modifiers, binding->keysym) & mask;; i = (i + 1) & mask) {
+                entry = &keybindings->entries[i];
+                if (entry->keysym == XKB_KEY_NoSymbol) {
+                        *entry = *binding;
+                        ++keybindings->len;
+                        return true;
+                }
+        }
+}
+
+void keybindings_finish(struct keybindings *keybindings)
+{
+        size_t i;
+
+        for (i = 0; i < keybindings->capacity; ++i)
+                free(keybindings->entries[i].command);
+        free(keybindings->entries);
+        keybindings->entries = NULL;
+        keybindings->capacity = 0;
+        keybindings->len = 0;
+}
+
+bool parse_keybinding_keys(const char *keys, uint32_t *modifiers, xkb_keysym_t *keysym)
+{
+        static const struct {
+                const char *name;
+                uint32_t modifier;
+        } modifier_names[] = {
+                { "Shift", WLR_MODIFIER_SHIFT },
+                { "Ctrl", WLR_MODIFIER_CTRL },
+                { "Control", WLR_MODIFIER_CTRL },
+                { "Alt", WLR_MODIFIER_ALT },
+                { "Mod1", WLR_MODIFIER_ALT },
+                { "Logo", WLR_MODIFIER_LOGO },
+                { "Super", WLR_MODIFIER_LOGO },
+                { "Mod4", WLR_MODIFIER_LOGO },
+        };
+        char buf[128], *part, *next;
+        size_t i;
+
+        if (strlen(keys) >= sizeof(buf))
+                return false;
+        strcpy(buf, keys);
+
+        // Every part but the last one is a modifier, e.g. "Alt+Shift+q"
+        *modifiers = 0;
+        for (part = buf; (next = strchr(part, '+')) != NULL; part = next + 1) {
+                *next = '\0';
+                for (i = 0; i < sizeof(modifier_names) / sizeof(modifier_names[0]); ++i) {
+                        if (strcasecmp(part, modifier_names[i].name) == 0)
+                                break;
+                }
+                if (i == sizeof(modifier_names) / sizeof(modifier_names[0]))
+                        return false;
+                *modifiers |= modifier_names[i].modifier;
+        }
+
+        // Bindings match the unshifted keysym, Shift has to be spelled out as a modifier
+        *keysym = xkb_keysym_to_lower(xkb_keysym_from_name(part, XKB_KEYSYM_CASE_INSENSITIVE));
+        return *keysym != XKB_KEY_NoSymbol;
+}
+
+bool parse_layout_mode(const char *name, enum layout_mode *mode)
+{
+        if (strcmp(name, "tiling") == 0)
+                *mode = LAYOUT_TILING;
+        else if (strcmp(name, "floating") == 0)
+                *mode = LAYOUT_FLOATING;
+        else if (strcmp(name, "monocle") == 0)
+                *mode = LAYOUT_MONOCLE;
+        else
+                return false;
+
+        return true;
+}
+
+// Parses "<keys> <action> [arguments]", e.g. "Alt+Return spawn foot"
+bool parse_keybinding(char *args, struct keybinding *binding)
+{
+        static const struct {
+                const char *name;
+                enum keybinding_action action;
+        } action_names[] = {
+                { "quit", KEYBINDING_QUIT },
+                { "close", KEYBINDING_CLOSE },
+                { "focus_next", KEYBINDING_FOCUS_NEXT },
+                { "focus_prev", KEYBINDING_FOCUS_PREV },
+                { "move", KEYBINDING_MOVE },
+                { "spawn", KEYBINDING_SPAWN },
+                { "layout", KEYBINDING_LAYOUT },
+                { "toggle_floating", KEYBINDING_TOGGLE_FLOATING },
+                { "workspace", KEYBINDING_WORKSPACE },
+                { "move_to_workspace", KEYBINDING_MOVE_TO_WORKSPACE },
+                { "restart", KEYBINDING_RESTART },
+        };
+        char *keys, *action, *rest;
+        size_t i;
+
+        memset(binding, 0, sizeof(*binding));
+
+        keys = strtok_r(args, " \t", &rest);
+        action = strtok_r(NULL, " \t", &rest);
+        if (!keys || !action || !parse_keybinding_keys(keys, &binding->modifiers, &binding->keysym))
+                return false;
+
+        for (i = 0; i < sizeof(action_names) / sizeof(action_names[0]); ++i) {
+                if (strcmp(action, action_names[i].name) == 0)
+                        break;
+        }
+        if (i == sizeof(action_names) / sizeof(action_names[0]))
+                return false;
+        binding->action = action_names[i].action;
+
+        while (*rest && isspace((unsigned char)*rest))
+                ++rest;
+
+        switch (binding->action) {
+        case KEYBINDING_MOVE:
+                return sscanf(rest, "%d %d", &binding->dx, &binding->dy) == 2;
+        case KEYBINDING_SPAWN:
+                if (*rest == '\0')
+                        return false;
+                binding->command = strdup(rest);
+                return binding->command != NULL;
+        case KEYBINDING_LAYOUT:
+                return parse_layout_mode(rest, &binding->layout);
+        case KEYBINDING_WORKSPACE:
+        case KEYBINDING_MOVE_TO_WORKSPACE:
+                // Numbered from 1, like the keys they're usually bound to
+                if (sscanf(rest, "%d", &binding->workspace) != 1 || binding->workspace < 1 ||
+                    binding->workspace > WORKSPACE_COUNT)
+                        return false;
+                --binding->workspace;
+                return true;
+        default:
+                return true;
+        }
+}
+
+bool config_bind(struct state *state, char *args)
+{
+        struct keybinding binding;
+
+        if (!parse_keybinding(args, &binding))
+                return false;
+
+        if (!keybindings_add(&state->keybindings, &binding)) {
+                free(binding.command);
+                return false;
+        }
+
+        return true;
+}
+
+bool parse_policy_toggle(const char *value, enum policy_toggle *toggle)
+{
+        if (strcmp(value, "on") == 0)
+                *toggle = POLICY_ON;
+        else if (strcmp(value, "off") == 0)
+                *toggle = POLICY_OFF;
+        else
+                return false;
+
+        return true;
+}
+
+bool config_output(struct state *state, char *args)
+{
+        struct output_policy *policy;
+        char *name, *setting, *value, *rest;
+        enum policy_toggle toggle;
+
+        name = strtok_r(args, " \t", &rest);
+        setting = strtok_r(NULL, " \t", &rest);
+        value = strtok_r(NULL, " \t", &rest);
+        if (!name || !setting || !value || !parse_policy_toggle(value, &toggle))
+                return false;
+
+        wl_list_for_each(policy, &state->output_policies, link) {
+                if (strcmp(policy->name, name) == 0)
+                        goto FOUND;
+        }
+
+        policy = calloc(1, sizeof(*policy));
+        if (!policy)
+                return false;
+        policy->name = strdup(name);
+        if (!policy->name) {
+                free(policy);
+                return false;
+        }
+        wl_list_insert(state->output_policies.prev, &policy->link);
+
+FOUND:
+        if (strcmp(setting, "adaptive_sync") == 0)
+                policy->adaptive_sync = toggle;
+        else if (strcmp(setting, "tearing") == 0)
+                policy->tearing = toggle;
+        else
+                return false;
+
+        return true;
+}
+
+bool config_client(struct state *state, char *args)
+{
+        struct client_policy *policy;
+        char *app_id, *setting, *value, *rest;
+        enum policy_toggle toggle;
+
+        app_id = strtok_r(args, " \t", &rest);
+        setting = strtok_r(NULL, " \t", &rest);
+        value = strtok_r(NULL, " \t", &rest);
+        if (!app_id || !setting || !value)
+                return false;
+
+        wl_list_for_each(policy, &state->client_policies, link) {
+                if (strcmp(policy->app_id, app_id) == 0)
+                        goto FOUND;
+        }
+
+        policy = calloc(1, sizeof(*policy));
+        if (!policy)
+                return false;
+        policy->app_id = strdup(app_id);
+        if (!policy->app_id) {
+                free(policy);
+                return false;
+        }
+        wl_list_insert(state->client_policies.prev, &policy->link);
+
+FOUND:
+        if (strcmp(setting, "tearing") == 0 && parse_policy_toggle(value, &toggle))
+                policy->tearing = toggle;
+        else if (strcmp(setting, "commit_budget") == 0 && strcmp(value, "off") == 0)
+                policy->commit_budget = -1;
+        else if (strcmp(setting, "commit_budget") == 0 && atoi(value) > 0)
+                policy->commit_budget = atoi(value);
+        else
+                return false;
+
+        return true;
+}
+
+bool config_layout(struct state *state, char *args)
+{
+        char *mode, *rest;
+
+        mode = strtok_r(args, " \t", &rest);
+        return mode && parse_layout_mode(mode, &state->default_layout);
+}
+
+bool config_master_ratio(struct state *state, char *args)
+{
+        char *end;
+        double ratio;
+
+        ratio = strtod(args, &end);
+        while (isspace((unsigned char)*end))
+                ++end;
+        if (end == args || *end != '\0' || ratio < 0.1 || ratio > 0.9)
+                return false;
+
+        state->master_ratio = ratio;
+        return true;
+}
+
+bool config_transaction_timeout(struct state *state, char *args)
+{
+        char *end;
+        long timeout;
+
+        timeout = strtol(args, &end, 10);
+        while (isspace((unsigned char)*end))
+                ++end;
+        if (end == args || *end != '\0' || timeout < 1 || timeout > 5000)
+                return false;
+
+        state->transaction.timeout_ms = (int)timeout;
+        return true;
+}
+
+bool config_clipboard_cache(struct state *state, char *args)
+{
+        char *end;
+        long kib;
+
+        if (strncmp(args, "off", 3) == 0 && (args[3] == '\0' || isspace((unsigned char)args[3]))) {
+                state->clipboard.cache_limit = 0;
+                return true;
+        }
+
+        kib = strtol(args, &end, 10);
+        while (isspace((unsigned char)*end))
+                ++end;
+        if (end == args || *end != '\0' || kib < 1 || kib > 1024 * 1024)
+                return false;
+
+        state->clipboard.cache_limit = (size_t)kib * 1024;
+        return true;
+}
+
+bool config_hidden_frame_rate(struct state *state, char *args)
+{
+        char *end;
+        long rate;
+
+        rate = strtol(args, &end, 10);
+        while (isspace((unsigned char)*end))
+                ++end;
+        if (end == args || *end != '\0' || rate < 0 || rate > 1000)
+                return false;
+
+        state->hidden_frame_rate = (int)rate;
+        return true;
+}
+
+// Configuration file
+// One directive per line, followed by its arguments. Empty lines and lines
+// starting with '#' are ignored.
+//   bind <modifiers+key> <action> [arguments]
+//   output <name|*> adaptive_sync|tearing on|off
+//   client <app_id|*> tearing on|off
+//   client <app_id|*> commit_budget <commits per second>|off
+//   hidden_frame_rate <frame callbacks per second, 0 for none>
+//   layout tiling|floating|monocle
+//   master_ratio <0.1 to 0.9>
+//   transaction_timeout <milliseconds>
+//   clipboard_cache <KiB per selection>|off
+bool config_load(struct state *state, const char *path)
+{
+        static const struct {
+                const char *name;
+                bool (*handler)(struct state *state, char *args);
+        } directives[] = {
+                { "bind", config_bind },
+                { "output", config_output },
+                { "client", config_client },
+                { "hidden_frame_rate", config_hidden_frame_rate },
+                { "layout", config_layout },
+                { "master_ratio", config_master_ratio },
+                { "transaction_timeout", config_transaction_timeout },
+                { "clipboard_cache", config_clipboard_cache },
+        };
+        FILE *file;
+        char *line = NULL, *directive, *args;
+        size_t line_size = 0, i;
+        ssize_t len;
+        int line_number = 0;
+        bool ok = true;
+
+        file = fopen(path, "r");
+        if (!file) {
+                wlr_log_errno(WLR_ERROR, "Failed to open config file '%s'", path);
+                return false;
+        }
+
+        while ((len = getline(&line, &line_size, file)) != -1) {
+                ++line_number;
+                if (len > 0 && line[len - 1] == '\n')
+                        line[len - 1] = '\0';
+
+                directive = line;
+                while (isspace((unsigned char)*directive))
+                        ++directive;
+                if (*directive == '\0' || *directive == '#')
+                        continue;
+
+                args = directive + strcspn(directive, " \t");
+                if (*args != '\0')
+                        *args++ = '\0';
+
+                for (i = 0; i < sizeof(directives) / sizeof(directives[0]); ++i) {
+                        if (strcmp(directive, directives[i].name) == 0)
+                                break;
+                }
+
+                // Bad lines are reported and skipped, the rest of the config still applies
+                if (i == sizeof(directives) / sizeof(directives[0]) || !directives[i].handler(state, args)) {
+                        wlr_log(WLR_ERROR, "%s:%d: invalid '%s' directive", path, line_number, directive);
+                        ok = false;
+                }
+        }
+
+        free(line);
+        fclose(file);
+
+        return ok;
+}
+
+void keybindings_init_defaults(struct state *state)
+{
+        char quit[] = "Alt+q quit", quit_shift[] = "Alt+Shift+q quit";
+
+        config_bind(state, quit);
+        config_bind(state, quit_shift);
+}
+
+void spawn(const char *command)
+{
+        pid_t pid = fork();
+
+        if (pid < 0) {
+                wlr_log_errno(WLR_ERROR, "Failed to spawn '%s'", command);
+                return;
+        }
+
+        // Fork twice, so the command gets reparented to init and we never
+        // have to reap it
+        if (pid == 0) {
+                setsid();
+                if (fork() == 0) {
+                        signal(SIGPIPE, SIG_DFL); // Ignored signals stay ignored across exec
+                        execl("/bin/sh", "/bin/sh", "-c", command, (char *)NULL);
+                        _exit(127);
+                }
+                _exit(0);
+        }
+
+        waitpid(pid, NULL, 0);
+}
+
+// Workspaces
+// Showing another workspace only flips two subtrees, the toplevels themselves
+// (and their scene nodes) stay untouched however many there are
+void workspace_switch(struct state *state, struct workspace *workspace)
+{
+        if (workspace == state->workspace)
+                return;
+
+        // Deliver the queued keys to the client that had focus when they were pressed
+        input_queue_flush(state);
+
+        // The old workspace goes out of sight, its layout changes don't have to wait for anything
+        transaction_apply(state, false);
+
+        wlr_scene_node_set_enabled(&state->workspace->tree->node, false);
+        wlr_scene_node_set_enabled(&workspace->tree->node, true);
+        if (!wl_list_empty(&state->workspace->toplevels))
+                hidden_frame_timer_arm(state);
+        state->workspace = workspace;
+        ++state->workspace_switches;
+
+        // Give keyboard focus back to the toplevel that had it when the workspace was left
+        if (state->focused_toplevel) {
+                wlr_xdg_toplevel_set_activated(state->focused_toplevel->xdg_toplevel, false);
+                state->focused_toplevel = NULL;
+        }
+        focus_next_mapped(state, NULL);
+
+        // Another toplevel may be under the cursor now
+        process_cursor_motion(state, (uint32_t)(now_ns() / 1000000));
+}
+
+void toplevel_move_to_workspace(struct toplevel_info *toplevel_info, struct workspace *workspace)
+{
+        struct state *state = toplevel_info->state;
+
+        if (toplevel_info->workspace == workspace)
+                return;
+
+        // Fullscreen is per workspace, the toplevel goes back to its place first
+        if (toplevel_info->fullscreen_output)
+                toplevel_set_fullscreen(toplevel_info, false, NULL);
+        transaction_remove(toplevel_info);
+        spatial_index_remove(&toplevel_info->workspace->spatial_index, toplevel_info);
+
+        wl_list_remove(&toplevel_info->link);
+        wl_list_insert(&workspace->toplevels, &toplevel_info->link);
+        toplevel_info->workspace = workspace;
+        wlr_scene_node_reparent(&toplevel_info->scene_tree->node, toplevel_layer(toplevel_info));
+        toplevel_raise(toplevel_info);
+        toplevel_update_index(toplevel_info);
+        if (workspace != state->workspace)
+                hidden_frame_timer_arm(state);
+
+        // It stays in the container of its output, the layout splits it by workspace
+        if (toplevel_info->container)
+                layout_mark_dirty(toplevel_info->container);
+
+        if (state->focused_toplevel == toplevel_info) {
+                wlr_xdg_toplevel_set_activated(toplevel_info->xdg_toplevel, false);
+                state->focused_toplevel = NULL;
+                focus_next_mapped(state, toplevel_info);
+        }
+}
+
+int toplevel_count(struct state *state)
+{
+        int i, count = 0;
+
+        for (i = 0; i < WORKSPACE_COUNT; ++i)
+                count += wl_list_length(&state->workspaces[i].toplevels);
+
+        return count;
+}
+
+// Session
+// The layout, workspace and focus of every toplevel with an app_id are saved
+// on exit. On the next start, relaunched toplevels are matched to the saved
+// ones at their initial commit, so they're configured with their old place
+// right away instead of being moved once mapped.
+void session_save(struct state *state)
+{
+        struct session_header header = { SESSION_MAGIC, SESSION_VERSION, 0, 0 };
+        struct session_record record;
+        struct toplevel_info *toplevel_info;
+        struct output_info *output_info;
+        struct wlr_box geometry;
+        const char *title;
+        char tmp_path[PATH_MAX];
+        bool failed;
+        FILE *file;
+        int i;
+
+        if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state->session.path) >= (int)sizeof(tmp_path)) {
+                wlr_log(WLR_ERROR, "Session path '%s' is too long", state->session.path);
+                return;
+        }
+
+        file = fopen(tmp_path, "wb");
+        if (!file) {
+                wlr_log_errno(WLR_ERROR, "Failed to create session file '%s'", tmp_path);
+                return;
+        }
+
+        // The count is filled in once the records are written
+        header.workspace = (uint32_t)state->workspace->index;
+        fwrite(&header, sizeof(header), 1, file);
+
+        for (i = 0; i < WORKSPACE_COUNT; ++i) {
+                // Least recently focused first
+                wl_list_for_each_reverse(toplevel_info, &state->workspaces[i].toplevels, link) {
+                        if (!toplevel_info->xdg_toplevel->app_id || !toplevel_info->xdg_toplevel->base->surface->mapped)
+                                continue;
+
+                        title = toplevel_info->xdg_toplevel->title ? toplevel_info->xdg_toplevel->title : "";
+                        output_info = toplevel_info->fullscreen_output ? toplevel_info->fullscreen_output
+                                                                       : toplevel_info->container;
+
+                        memset(&record, 0, sizeof(record));
+                        record.workspace = (uint8_t)i;
+                        if (toplevel_info->floating)
+                                record.flags |= SESSION_FLOATING;
+                        if (toplevel_info->fullscreen_output)
+                                record.flags |= SESSION_FULLSCREEN;
+                        if (toplevel_info == state->focused_toplevel)
+                                record.flags |= SESSION_FOCUSED;
+                        record.app_id_len = (uint16_t)strnlen(toplevel_info->xdg_toplevel->app_id, UINT16_MAX);
+                        record.title_len = (uint16_t)strnlen(title, UINT16_MAX);
+                        record.output_len = output_info ? (uint16_t)strnlen(output_info->output->name, UINT16_MAX) : 0;
+
+                        // Tiled toplevels get their place from the layout, fullscreen
+                        // ones go back where they were before
+                        if (toplevel_info->container && toplevel_is_floating(toplevel_info)) {
+                                geometry = toplevel_info->saved_geometry;
+                                if (!toplevel_info->fullscreen_output) {
+                                        wlr_xdg_surface_get_geometry(toplevel_info->xdg_toplevel->base, &geometry);
+                                        geometry.x = toplevel_info->scene_tree->node.x;
+                                        geometry.y = toplevel_info->scene_tree->node.y;
+                                }
+                                record.x = geometry.x;
+                                record.y = geometry.y;
+                                record.width = geometry.width;
+                                record.height = geometry.height;
+                        }
+
+                        fwrite(&record, sizeof(record), 1, file);
+                        fwrite(toplevel_info->xdg_toplevel->app_id, 1, record.app_id_len, file);
+                        fwrite(title, 1, record.title_len, file);
+                        if (output_info)
+                                fwrite(output_info->output->name, 1, record.output_len, file);
+                        ++header.count;
+                }
+        }
+
+        rewind(file);
+        fwrite(&header, sizeof(header), 1, file);
+        failed = ferror(file);
+        if (fclose(file) != 0)
+                failed = true;
+
+        // Replace the old snapshot atomically, a crash halfway through keeps it intact
+        if (failed || rename(tmp_path, state->session.path) < 0) {
+                wlr_log_errno(WLR_ERROR, "Failed to write session file '%s'", state->session.path);
+                unlink(tmp_path);
+                return;
+        }
+
+        wlr_log(WLR_INFO, "Saved %u toplevels to the session file", header.count);
+}
+
+char *session_read_string(FILE *file, uint16_t len)
+{
+        char *string = malloc((size_t)len + 1);
+
+        if (!string)
+                return NULL;
+        if (fread(string, 1, len, file) != len) {
+                free(string);
+                return NULL;
+        }
+        string[len] = '\0';
+
+        return string;
+}
+
+void session_finish(struct state *state)
+{
+        size_t i;
+
+        for (i = 0; i < state->session.len; ++i) {
+                free(state->session.entries[i].app_id);
+                free(state->session.entries[i].title);
+                free(state->session.entries[i].output);
+        }
+        free(state->session.entries);
+        state->session.entries = NULL;
+        state->session.len = 0;
+}
+
+// Read the snapshot of the previous run, a missing or unreadable file just
+// starts an empty session
+void session_load(struct state *state)
+{
+        struct session_header header;
+        struct session_record record;
+        struct session_entry *entry;
+        bool valid = true;
+        FILE *file;
+
+        file = fopen(state->session.path, "rb");
+        if (!file)
+                return;
+
+        if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != SESSION_MAGIC ||
+            header.version != SESSION_VERSION || header.workspace >= WORKSPACE_COUNT || header.count > UINT16_MAX) {
+                wlr_log(WLR_ERROR, "Ignoring invalid session file '%s'", state->session.path);
+                fclose(file);
+                return;
+        }
+
+        state->session.entries = calloc(header.count, sizeof(*state->session.entries));
+        if (header.count && !state->session.entries) {
+                fclose(file);
+                return;
+        }
+
+        while (valid && state->session.len < header.count) {
+                if (fread(&record, sizeof(record), 1, file) != 1 || record.workspace >= WORKSPACE_COUNT) {
+                        valid = false;
+                        break;
+                }
+
+                // Counted right away, so session_finish frees a partially read entry
+                entry = &state->session.entries[state->session.len++];
+                entry->app_id = session_read_string(file, record.app_id_len);
+                entry->title = session_read_string(file, record.title_len);
+                entry->output = record.output_len ? session_read_string(file, record.output_len) : NULL;
+                valid = entry->app_id && entry->title && (!record.output_len || entry->output);
+
+                entry->workspace = record.workspace;
+                entry->flags = record.flags;
+                entry->box.x = record.x;
+                entry->box.y = record.y;
+                entry->box.width = record.width;
+                entry->box.height = record.height;
+        }
+        fclose(file);
+
+        if (!valid) {
+                wlr_log(WLR_ERROR, "Ignoring truncated session file '%s'", state->session.path);
+                session_finish(state);
+                return;
+        }
+
+        state->session.workspace = (int)header.workspace;
+        wlr_log(WLR_INFO, "Loaded %zu toplevels from the session file", state->session.len);
+}
+
+// Titles often change (e.g. with the open document), so the first unused
+// entry with the same app_id is used when none has the same title
+struct session_entry *session_match(struct state *state, struct wlr_xdg_toplevel *xdg_toplevel)
+{
+        struct session_entry *entry, *fallback = NULL;
+        size_t i;
+
+        if (!xdg_toplevel->app_id)
+                return NULL;
+
+        for (i = 0; i < state->session.len; ++i) {
+                entry = &state->session.entries[i];
+                if (entry->used || strcmp(entry->app_id, xdg_toplevel->app_id) != 0)
+                        continue;
+                if (xdg_toplevel->title && strcmp(entry->title, xdg_toplevel->title) == 0)
+                        return entry;
+                if (!fallback)
+                        fallback = entry;
+        }
+
+        return fallback;
+}
+
+int handle_session_timer(void *data)
+{
+        struct state *state = (struct state *)data;
+        size_t i, unused = 0;
+
+        for (i = 0; i < state->session.len; ++i)
+                unused += !state->session.entries[i].used;
+        if (unused)
+                wlr_log(WLR_INFO, "Dropping %zu session entries that weren't matched", unused);
+
+        // The next toplevels are new, there's nothing to match them against
+        session_finish(state);
+
+        return 0;
+}
+
+// Put the toplevel back on its workspace, returns the output it was on (or
+// fallback, if that output is gone)
+struct output_info *session_restore(struct toplevel_info *toplevel_info, struct session_entry *entry,
+                                    struct output_info *fallback)
+{
+        struct state *state = toplevel_info->state;
+        struct output_info *output_info;
+
+        entry->used = true;
+        ++state->session.restored;
+        toplevel_info->session_restored = true;
+        toplevel_info->session_focused = entry->flags & SESSION_FOCUSED;
+
+        toplevel_move_to_workspace(toplevel_info, &state->workspaces[entry->workspace]);
+        if (!(entry->flags & SESSION_FLOATING) != !toplevel_info->floating)
+                toplevel_toggle_floating(toplevel_info);
+
+        if (entry->output) {
+                wl_list_for_each(output_info, &state->outputs, link) {
+                        if (output_info->scene_output && strcmp(output_info->output->name, entry->output) == 0)
+                                return output_info;
+                }
+        }
+
+        return fallback;
+}
+
+// Floating toplevels get their old size and position, unless it's not on
+// their output anymore (they're centered then, like new ones)
+void session_restore_floating(struct toplevel_info *toplevel_info, struct session_entry *entry)
+{
+        struct state *state = toplevel_info->state;
+        struct wlr_box output_box;
+
+        if (wlr_box_empty(&entry->box))
+                return;
+
+        wlr_output_layout_get_box(state->output_layout, toplevel_info->container->output, &output_box);
+        if (!wlr_box_contains_point(&output_box, entry->box.x + entry->box.width / 2.0,
+                                    entry->box.y + entry->box.height / 2.0))
+                return;
+
+        wlr_xdg_toplevel_set_size(toplevel_info->xdg_toplevel, entry->box.width, entry->box.height);
+        toplevel_info->configure_pending = false;
+        ++state->configures_sent;
+        toplevel_set_position(toplevel_info, entry->box.x, entry->box.y);
+        toplevel_info->placed = true;
+}
+
+void run_keybinding(struct state *state, const struct keybinding *binding)
+{
+        struct toplevel_info *focused = state->focused_toplevel;
+        struct toplevel_info *last;
+        struct output_info *output_info;
+
+        switch (binding->action) {
+        case KEYBINDING_QUIT:
+                wl_display_terminate(state->display);
+                break;
+        case KEYBINDING_CLOSE:
+                if (focused)
+                        wlr_xdg_toplevel_send_close(focused->xdg_toplevel);
+                break;
+        case KEYBINDING_FOCUS_NEXT:
+                // The least recently focused toplevel is at the back of the list
+                wl_list_for_each_reverse(last, &state->workspace->toplevels, link) {
+                        if (last != focused && last->xdg_toplevel->base->surface->mapped) {
+                                focus_toplevel(last);
+                                break;
+                        }
+                }
+                break;
+        case KEYBINDING_FOCUS_PREV:
+                // Undo a focus_next: send the focused toplevel to the back
+                if (focused) {
+                        wl_list_remove(&focused->link);
+                        wl_list_insert(state->workspace->toplevels.prev, &focused->link);
+                        focus_next_mapped(state, focused);
+                }
+                break;
+        case KEYBINDING_MOVE:
+                if (focused)
+                        toplevel_set_position(focused, focused->scene_tree->node.x + binding->dx,
+                                              focused->scene_tree->node.y + binding->dy);
+                break;
+        case KEYBINDING_SPAWN:
+                spawn(binding->command);
+                break;
+        case KEYBINDING_LAYOUT:
+                output_info = focused && focused->container ? focused->container : output_at_cursor(state);
+                if (output_info)
+                        layout_set_mode(output_info, binding->layout);
+                break;
+        case KEYBINDING_TOGGLE_FLOATING:
+                if (focused)
+                        toplevel_toggle_floating(focused);
+                break;
+        case KEYBINDING_WORKSPACE:
+                workspace_switch(state, &state->workspaces[binding->workspace]);
+                break;
+        case KEYBINDING_MOVE_TO_WORKSPACE:
+                if (focused)
+                        toplevel_move_to_workspace(focused, &state->workspaces[binding->workspace]);
+                break;
+        case KEYBINDING_RESTART:
+                // main() saves the session and runs the compositor again once everything
+                // is torn down. The clients are disconnected and not relaunched, the
+                // session only places them again if they're started within SESSION_GRACE_MS.
+                state->restart = true;
+                wl_display_terminate(state->display);
+                break;
+        }
+}
+
+bool handle_keybinding(struct keyboard_info *keyboard_info, uint32_t keycode)
+{
+        struct wlr_keyboard *keyboard = keyboard_info->keyboard;
+        struct keybinding *binding;
+        const xkb_keysym_t *syms;
+        uint32_t modifiers;
+        int nsyms, i;
+
+        modifiers = wlr_keyboard_get_modifiers(keyboard) & KEYBINDING_MODIFIERS;
+
+        // Use the unshifted keysyms (level 0) of the active layout, so the same
+        // binding matches no matter which modifiers are held
+        nsyms = xkb_keymap_key_get_syms_by_level(keyboard->keymap, keycode,
+                                                 xkb_state_key_get_layout(keyboard->xkb_state, keycode), 0, &syms);
+        for (i = 0; i < nsyms; ++i) {
+                binding = keybindings_find(&keyboard_info->state->keybindings, modifiers, xkb_keysym_to_lower(syms[i]));
+                if (binding) {
+                        run_keybinding(keyboard_info->state, binding);
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+void handle_keyboard_key(struct wl_listener *listener, void *data)
+{
+        struct keyboard_info *keyboard_info = wl_container_of(listener, keyboard_info, listener_key);
+        struct state *state = keyboard_info->state;
+        struct wlr_keyboard_key_event *event = (struct wlr_keyboard_key_event *)data;
+        struct queued_input *queued;
+        uint8_t *consumed, bit;
+
+        TRACE(TRACE_KEYBOARD_KEY, event->keycode, event->state);
+        device_count_event(&keyboard_info->keyboard->base, event->time_msec);
+
+        if (event->keycode > KEYCODE_MAX)
+                return;
+        consumed = &keyboard_info->consumed_keys[event->keycode / 8];
+        bit = 1 << (event->keycode % 8);
+
+        // Keys that triggered a binding are not forwarded, and neither are their
+        // releases (the client never saw them being pressed)
+        if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+                // Convert libinput keycode to xkbcommon keycode
+                if (handle_keybinding(keyboard_info, event->keycode + 8)) {
+                        *consumed |= bit;
+                        return;
+                }
+        } else if (*consumed & bit) {
+                *consumed &= ~bit;
+                return;
+        }
+
+        // If we didn't handle the key event internally, we forward it to the client
+        queued = input_queue_push(state);
+        queued->is_key = true;
+        queued->keyboard = keyboard_info->keyboard;
+        queued->time_msec = event->time_msec;
+        queued->keycode = event->keycode;
+        queued->key_state = event->state;
+}
+
+bool strings_equal(const char *a, const char *b)
+{
+        if (!a || !b)
+                return a == b;
+        return strcmp(a, b) == 0;
+}
+
+char *strdup_or_null(const char *string)
+{
+        return string ? strdup(string) : NULL;
+}
+
+void keymap_entry_destroy(struct keymap_entry *entry)
+{
+        wl_list_remove(&entry->link);
+        xkb_keymap_unref(entry->keymap);
+        free((char *)entry->names.rules);
+        free((char *)entry->names.model);
+        free((char *)entry->names.layout);
+        free((char *)entry->names.variant);
+        free((char *)entry->names.options);
+        free(entry);
+}
+
+struct keymap_entry *keymap_acquire(struct state *state, const struct xkb_rule_names *names)
+{
+        struct keymap_entry *entry;
+
+        wl_list_for_each(entry, &state->keymaps, link) {
+                if (strings_equal(entry->names.rules, names->rules) &&
+                    strings_equal(entry->names.model, names->model) &&
+                    strings_equal(entry->names.layout, names->layout) &&
+                    strings_equal(entry->names.variant, names->variant) &&
+                    strings_equal(entry->names.options, names->options)) {
+                        // Keep the list ordered by use, so eviction drops the stalest keymaps
+                        wl_list_remove(&entry->link);
+                        wl_list_insert(&state->keymaps, &entry->link);
+                        ++entry->refs;
+                        return entry;
+                }
+        }
+
+        // Not cached, compiling a keymap is the expensive part of a keyboard hotplug
+        entry = calloc(1, sizeof(*entry));
+        if (!entry)
+                return NULL;
+
+        entry->keymap = xkb_keymap_new_from_names(state->xkb_context, names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+        if (!entry->keymap) {
+                free(entry);
+                return NULL;
+        }
+
+        entry->names.rules = strdup_or_null(names->rules);
+        entry->names.model = strdup_or_null(names->model);
+        entry->names.layout = strdup_or_null(names->layout);
+        entry->names.variant = strdup_or_null(names->variant);
+        entry->names.options = strdup_or_null(names->options);
+        entry->refs = 1;
+        wl_list_insert(&state->keymaps, &entry->link);
+
+        // A missing copy would read as "unset" and match other names later on
+        if ((names->rules && !entry->names.rules) || (names->model && !entry->names.model) ||
+            (names->layout && !entry->names.layout) || (names->variant && !entry->names.variant) ||
+            (names->options && !entry->names.options)) {
+                keymap_entry_destroy(entry);
+                return NULL;
+        }
+
+        return entry;
+}
+
+void keymap_release(struct state *state, struct keymap_entry *entry)
+{
+        struct keymap_entry *cached, *tmp;
+        int unused = 0;
+
+        --entry->refs;
+
+        // Unused keymaps stay cached for the next hotplug, up to a limit
+        wl_list_for_each_safe(cached, tmp, &state->keymaps, link) {
+                if (cached->refs > 0)
+                        continue;
+                if (++unused > KEYMAP_CACHE_SIZE)
+                        keymap_entry_destroy(cached);
+        }
+}
+
+void handle_keyboard_destroy(struct wl_listener *listener, void *data)
+{
+        struct keyboard_info *keyboard_info = wl_container_of(listener, keyboard_info, listener_destroy);
+
+        TRACE(TRACE_KEYBOARD_DESTROY, 0, 0);
+
+        // Queued events reference the keyboard, deliver them while it still exists
+        input_queue_flush(keyboard_info->state);
+
+	wl_list_remove(&keyboard_info->listener_modifiers.link);
+	wl_list_remove(&keyboard_info->listener_key.link);
+	wl_list_remove(&keyboard_info->listener_destroy.link);
+	wl_list_remove(&keyboard_info->link);
+        if (keyboard_info->keymap_entry)
+                keymap_release(keyboard_info->state, keyboard_info->keymap_entry);
+        pool_free(&keyboard_info->state->pools.keyboards, keyboard_info);
+}
+
+void setup_new_keyboard(struct state *state, struct wlr_input_device *device)
+{
+        struct wlr_keyboard *keyboard = wlr_keyboard_from_input_device(device);
+        struct keyboard_info *keyboard_info = pool_alloc(&state->pools.keyboards);
+        struct xkb_rule_names names;
+        int64_t start = now_ns();
+
+        if (!keyboard_info) {
+                wlr_log(WLR_ERROR, "Out of memory, ignoring keyboard '%s'", device->name);
+                return;
+        }
+
+        keyboard_info->state = state;
+        keyboard_info->keyboard = keyboard;
+
+        // Setup XKB keymap for this keyboard with its defaults (e.g US layout,
+        // or whatever the XKB_DEFAULT_* environment variables say). Keyboards
+        // with the same names share a single compiled keymap.
+        names.rules = getenv("XKB_DEFAULT_RULES");
+        names.model = getenv("XKB_DEFAULT_MODEL");
+        names.layout = getenv("XKB_DEFAULT_LAYOUT");
+        names.variant = getenv("XKB_DEFAULT_VARIANT");
+        names.options = getenv("XKB_DEFAULT_OPTIONS");
+        keyboard_info->keymap_entry = keymap_acquire(state, &names);
+        if (keyboard_info->keymap_entry)
+                wlr_keyboard_set_keymap(keyboard, keyboard_info->keymap_entry->keymap);
+        else
+                wlr_log(WLR_ERROR, "Failed to compile keymap for keyboard '%s'", device->name);
+        wlr_keyboard_set_repeat_info(keyboard, 50, 300); // Key repeat frequency and delay
+
+        // Setup keyboard event listeners
+        keyboard_info->listener_modifiers.notify = handle_keyboard_modifiers;
+        wl_signal_add(&keyboard->events.modifiers, &keyboard_info->listener_modifiers);
+        keyboard_info->listener_key.notify = handle_keyboard_key;
+        wl_signal_add(&keyboard->events.key, &keyboard_info->listener_key);
+        keyboard_info->listener_destroy.notify = handle_keyboard_destroy;
+        wl_signal_add(&device->events.destroy, &keyboard_info->listener_destroy);
+
+        // Finish keyboard setup
+        wlr_seat_set_keyboard(state->seat, keyboard_info->keyboard);
+        wl_list_insert(&state->keyboards, &keyboard_info->link);
+
+        wlr_log(WLR_DEBUG, "Keyboard '%s' set up in %.1f us", device->name, (now_ns() - start) / 1000.0);
+}
+
+void handle_device_destroy(struct wl_listener *listener, void *data)
+{
+        struct device_info *device_info = wl_container_of(listener, device_info, listener_destroy);
+
+        device_info->device->data = NULL;
+        wl_list_remove(&device_info->listener_destroy.link);
+        wl_list_remove(&device_info->link);
+        pool_free(&device_info->state->pools.devices, device_info);
+}
+
+void input_device_add(struct state *state, struct wlr_input_device *device)
+{
+        struct device_info *device_info;
+
+        // The device works without its metrics, so running out of memory isn't fatal here
+        device_info = (struct device_info *)pool_alloc(&state->pools.devices);
+        if (device_info) {
+                device_info->state = state;
+                device_info->device = device;
+                device->data = device_info;
+                device_info->listener_destroy.notify = handle_device_destroy;
+                wl_signal_add(&device->events.destroy, &device_info->listener_destroy);
+                wl_list_insert(state->devices.prev, &device_info->link);
+        }
+
+        switch (device->type) {
+        case WLR_INPUT_DEVICE_KEYBOARD:
+                setup_new_keyboard(state, device);
+                break;
+        case WLR_INPUT_DEVICE_POINTER:
+                wlr_cursor_attach_input_device(state->cursor, device);
+                break;
+        default:
+                break;
+        }
+}
+
+void handle_new_input(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_new_input);
+        struct wlr_input_device *device = (struct wlr_input_device *)data;
+                
+        wlr_log(WLR_INFO, "New input");
+
+        input_device_add(state, device);
+}
+
+void handle_request_set_cursor(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_request_set_cursor);
+        struct wlr_seat_pointer_request_set_cursor_event *event = (struct wlr_seat_pointer_request_set_cursor_event *)data;
+        struct wlr_seat_client *focused_client = state->seat->pointer_state.focused_client;
+
+        TRACE(TRACE_REQUEST_SET_CURSOR, focused_client == event->seat_client, 0);
+
+        // Anyone can send this request, but we must only accept
+        // cursor changes by the seat client
+        if (focused_client != event->seat_client)
+                return;
+
+        cursor_set_surface(state, event->surface, event->hotspot_x, event->hotspot_y);
+}
+
+// Clipboard
+// Selection data normally goes straight from the source client to the pasting
+// client, we only pass the pipe along. With clipboard_cache set, the common
+// MIME types of every new selection are also copied into a snapshot, so the
+// selection can still be pasted once its client exits. All copies stream
+// through non-blocking pipes on the event loop, one chunk per wakeup.
+void clipboard_snapshot_unref(struct clipboard_snapshot *snapshot)
+{
+        struct clipboard_entry *entry, *tmp;
+
+        if (--snapshot->refs > 0)
+                return;
+
+        if (snapshot->data_source || snapshot->primary_source)
+                wl_list_remove(&snapshot->listener_source_destroy.link);
+
+        wl_list_for_each_safe(entry, tmp, &snapshot->entries, link) {
+                wl_list_remove(&entry->link);
+                free(entry->mime_type);
+                free(entry->data);
+                free(entry);
+        }
+        free(snapshot);
+}
+
+struct clipboard_snapshot *clipboard_snapshot_create(struct state *state, bool primary)
+{
+        struct clipboard_snapshot *snapshot;
+
+        snapshot = calloc(1, sizeof(*snapshot));
+        if (!snapshot)
+                return NULL;
+
+        snapshot->state = state;
+        snapshot->refs = 1;
+        snapshot->primary = primary;
+        snapshot->start_ns = now_ns();
+        wl_list_init(&snapshot->entries);
+
+        return snapshot;
+}
+
+struct clipboard_entry *clipboard_entry_add(struct clipboard_snapshot *snapshot, const char *mime_type)
+{
+        struct clipboard_entry *entry;
+
+        entry = calloc(1, sizeof(*entry));
+        if (!entry)
+                return NULL;
+
+        entry->mime_type = strdup(mime_type);
+        if (!entry->mime_type) {
+                free(entry);
+                return NULL;
+        }
+        wl_list_insert(snapshot->entries.prev, &entry->link);
+
+        return entry;
+}
+
+void clipboard_entry_remove(struct clipboard_snapshot *snapshot, struct clipboard_entry *entry)
+{
+        snapshot->size -= entry->len;
+        wl_list_remove(&entry->link);
+        free(entry->mime_type);
+        free(entry->data);
+        free(entry);
+}
+
+void handle_clipboard_install_idle(void *data);
+
+void clipboard_schedule_install(struct state *state)
+{
+        if (!state->clipboard.install_idle)
+                state->clipboard.install_idle = wl_event_loop_add_idle(state->event_loop, handle_clipboard_install_idle, state);
+}
+
+void clipboard_transfer_destroy(struct clipboard_transfer *transfer)
+{
+        struct clipboard_snapshot *snapshot = transfer->snapshot;
+
+        wl_event_source_remove(transfer->source);
+        close(transfer->fd);
+        wl_list_remove(&transfer->link);
+
+        // The cache takes over once the snapshot is complete and its client is gone
+        if (transfer->reading && --snapshot->reading == 0) {
+                snapshot->end_ns = now_ns();
+                if (!snapshot->data_source && !snapshot->primary_source)
+                        clipboard_schedule_install(snapshot->state);
+        }
+
+        clipboard_snapshot_unref(snapshot);
+        free(transfer);
+}
+
+void clipboard_transfer_read(struct clipboard_transfer *transfer)
+{
+        struct clipboard_snapshot *snapshot = transfer->snapshot;
+        struct clipboard_entry *entry = transfer->entry;
+        struct state *state = snapshot->state;
+        size_t capacity;
+        ssize_t len;
+        char *data;
+
+        // Grow geometrically, the limit below keeps this bounded
+        if (entry->capacity - entry->len < CLIPBOARD_CHUNK_SIZE) {
+                capacity = entry->capacity ? entry->capacity * 2 : CLIPBOARD_CHUNK_SIZE;
+                data = realloc(entry->data, capacity);
+                if (!data)
+                        goto ABORT;
+                entry->data = data;
+                entry->capacity = capacity;
+        }
+
+        len = read(transfer->fd, entry->data + entry->len, CLIPBOARD_CHUNK_SIZE);
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+        if (len < 0)
+                goto ABORT;
+
+        if (len == 0) {
+                entry->complete = true;
+                clipboard_transfer_destroy(transfer);
+                return;
+        }
+
+        entry->len += len;
+        snapshot->size += len;
+        state->clipboard.bytes_read += len;
+        if (snapshot->size > state->clipboard.cache_limit) {
+                wlr_log(WLR_DEBUG, "Selection '%s' is over the cache limit, not caching it", entry->mime_type);
+                goto ABORT;
+        }
+
+        return;
+
+ABORT:
+        clipboard_entry_remove(snapshot, entry);
+        clipboard_transfer_destroy(transfer);
+}
+
+void clipboard_transfer_write(struct clipboard_transfer *transfer)
+{
+        struct clipboard_entry *entry = transfer->entry;
+        size_t len = entry->len - transfer->offset;
+        ssize_t written;
+
+        if (len > CLIPBOARD_CHUNK_SIZE)
+                len = CLIPBOARD_CHUNK_SIZE;
+
+        if (len > 0) {
+                written = write(transfer->fd, entry->data + transfer->offset, len);
+                if (written < 0 && (errno == EAGAIN || errno == EINTR))
+                        return;
+
+                // The pasting client may close the pipe early (EPIPE), that's fine
+                if (written < 0) {
+                        clipboard_transfer_destroy(transfer);
+                        return;
+                }
+
+                transfer->offset += written;
+                transfer->snapshot->state->clipboard.bytes_written += written;
+        }
+
+        // Closing the pipe tells the client that everything was sent
+        if (transfer->offset == entry->len)
+                clipboard_transfer_destroy(transfer);
+}
+
+int handle_clipboard_transfer(int fd, uint32_t mask, void *data)
+{
+        struct clipboard_transfer *transfer = (struct clipboard_transfer *)data;
+        struct state *state = transfer->snapshot->state;
+        int64_t start = now_ns(), elapsed;
+
+        // Hangups are read as end of file (or write errors)
+        if (transfer->reading)
+                clipboard_transfer_read(transfer);
+        else
+                clipboard_transfer_write(transfer);
+
+        elapsed = now_ns() - start;
+        if (elapsed > state->clipboard.max_stall_ns)
+                state->clipboard.max_stall_ns = elapsed;
+
+        return 0;
+}
+
+// Takes ownership of fd
+bool clipboard_transfer_start(struct clipboard_snapshot *snapshot, struct clipboard_entry *entry, int fd, bool reading)
+{
+        struct state *state = snapshot->state;
+        struct clipboard_transfer *transfer;
+
+        transfer = calloc(1, sizeof(*transfer));
+        if (!transfer || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+                goto ERROR;
+
+        transfer->source = wl_event_loop_add_fd(state->event_loop, fd, reading ? WL_EVENT_READABLE : WL_EVENT_WRITABLE,
+                                                handle_clipboard_transfer, transfer);
+        if (!transfer->source)
+                goto ERROR;
+
+        transfer->snapshot = snapshot;
+        transfer->entry = entry;
+        transfer->fd = fd;
+        transfer->reading = reading;
+        ++snapshot->refs;
+        if (reading)
+                ++snapshot->reading;
+        wl_list_insert(&state->clipboard.transfers, &transfer->link);
+
+        return true;
+
+ERROR:
+        wlr_log_errno(WLR_ERROR, "Failed to start a clipboard transfer");
+        free(transfer);
+        close(fd);
+        return false;
+}
+
+int clipboard_pipe(int fds[2])
+{
+        if (pipe(fds) < 0)
+                return -1;
+
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        return 0;
+}
+
+void clipboard_cache_send(struct clipboard_snapshot *snapshot, const char *mime_type, int fd)
+{
+        struct clipboard_entry *entry;
+
+        wl_list_for_each(entry, &snapshot->entries, link) {
+                if (entry->complete && strcmp(entry->mime_type, mime_type) == 0) {
+                        ++snapshot->state->clipboard.pastes_served;
+                        clipboard_transfer_start(snapshot, entry, fd, false);
+                        return;
+                }
+        }
+
+        close(fd);
+}
+
+void cache_data_source_send(struct wlr_data_source *wlr_source, const char *mime_type, int32_t fd)
+{
+        struct cache_data_source *source = wl_container_of(wlr_source, source, base);
+
+        clipboard_cache_send(source->snapshot, mime_type, fd);
+}
+
+void cache_data_source_destroy(struct wlr_data_source *wlr_source)
+{
+        struct cache_data_source *source = wl_container_of(wlr_source, source, base);
+
+        clipboard_snapshot_unref(source->snapshot);
+        free(source);
+}
+
+const struct wlr_data_source_impl cache_data_source_impl = {
+        .send = cache_data_source_send,
+        .destroy = cache_data_source_destroy,
+};
+
+void cache_primary_source_send(struct wlr_primary_selection_source *wlr_source, const char *mime_type, int fd)
+{
+        struct cache_primary_source *source = wl_container_of(wlr_source, source, base);
+
+        clipboard_cache_send(source->snapshot, mime_type, fd);
+}
+
+void cache_primary_source_destroy(struct wlr_primary_selection_source *wlr_source)
+{
+        struct cache_primary_source *source = wl_container_of(wlr_source, source, base);
+
+        clipboard_snapshot_unref(source->snapshot);
+        free(source);
+}
+
+const struct wlr_primary_selection_source_impl cache_primary_source_impl = {
+        .send = cache_primary_source_send,
+        .destroy = cache_primary_source_destroy,
+};
+
+bool clipboard_add_mime_type(struct wl_array *mime_types, const char *mime_type)
+{
+        char **slot;
+
+        slot = wl_array_add(mime_types, sizeof(*slot));
+        if (!slot)
+                return false;
+
+        *slot = strdup(mime_type);
+        if (!*slot) {
+                mime_types->size -= sizeof(*slot);
+                return false;
+        }
+
+        return true;
+}
+
+// Make the snapshot the selection, offering the MIME types that were read completely
+void clipboard_cache_install(struct clipboard_snapshot *snapshot)
+{
+        struct state *state = snapshot->state;
+        struct cache_data_source *data_source;
+        struct cache_primary_source *primary_source;
+        struct wl_array *mime_types;
+        struct clipboard_entry *entry;
+
+        if (snapshot->primary) {
+                primary_source = calloc(1, sizeof(*primary_source));
+                if (!primary_source)
+                        return;
+                wlr_primary_selection_source_init(&primary_source->base, &cache_primary_source_impl);
+                primary_source->snapshot = snapshot;
+                mime_types = &primary_source->base.mime_types;
+        } else {
+                data_source = calloc(1, sizeof(*data_source));
+                if (!data_source)
+                        return;
+                wlr_data_source_init(&data_source->base, &cache_data_source_impl);
+                data_source->snapshot = snapshot;
+                mime_types = &data_source->base.mime_types;
+        }
+        ++snapshot->refs;
+
+        wl_list_for_each(entry, &snapshot->entries, link) {
+                if (entry->complete)
+                        clipboard_add_mime_type(mime_types, entry->mime_type);
+        }
+
+        // Destroying the source frees the MIME types and drops its reference
+        if (snapshot->primary) {
+                if (mime_types->size == 0)
+                        wlr_primary_selection_source_destroy(&primary_source->base);
+                else
+                        wlr_seat_set_primary_selection(state->seat, &primary_source->base,
+                                                       wl_display_next_serial(state->display));
+        } else {
+                if (mime_types->size == 0)
+                        wlr_data_source_destroy(&data_source->base);
+                else
+                        wlr_seat_set_selection(state->seat, &data_source->base, wl_display_next_serial(state->display));
+        }
+}
+
+// Runs on idle, the seat must not be changed from within the destroy of its selection source
+void handle_clipboard_install_idle(void *data)
+{
+        struct state *state = (struct state *)data;
+        struct clipboard_snapshot *snapshot;
+        bool replaced;
+        int i;
+
+        state->clipboard.install_idle = NULL;
+
+        for (i = 0; i < 2; ++i) {
+                snapshot = state->clipboard.snapshots[i];
+                if (!snapshot || snapshot->data_source || snapshot->primary_source || snapshot->reading > 0)
+                        continue;
+
+                state->clipboard.snapshots[i] = NULL;
+                replaced = i ? state->seat->primary_selection_source != NULL : state->seat->selection_source != NULL;
+                if (!replaced)
+                        clipboard_cache_install(snapshot);
+                clipboard_snapshot_unref(snapshot);
+        }
+}
+
+void handle_clipboard_source_destroy(struct wl_listener *listener, void *data)
+{
+        struct clipboard_snapshot *snapshot = wl_container_of(listener, snapshot, listener_source_destroy);
+
+        wl_list_remove(&snapshot->listener_source_destroy.link);
+        snapshot->data_source = NULL;
+        snapshot->primary_source = NULL;
+        if (snapshot->reading == 0)
+                clipboard_schedule_install(snapshot->state);
+}
+
+// Forget the snapshot of the previous selection, reads still in flight are cancelled
+void clipboard_snapshot_drop(struct state *state, bool primary)
+{
+        struct clipboard_snapshot *snapshot = state->clipboard.snapshots[primary];
+        struct clipboard_transfer *transfer, *tmp;
+
+        if (!snapshot)
+                return;
+
+        state->clipboard.snapshots[primary] = NULL;
+        wl_list_for_each_safe(transfer, tmp, &state->clipboard.transfers, link) {
+                if (transfer->snapshot == snapshot && transfer->reading)
+                        clipboard_transfer_destroy(transfer);
+        }
+        clipboard_snapshot_unref(snapshot);
+}
+
+bool clipboard_mime_type_cacheable(const char *mime_type)
+{
+        return strncmp(mime_type, "text/", 5) == 0 || strncmp(mime_type, "image/", 6) == 0 ||
+               strcmp(mime_type, "UTF8_STRING") == 0 || strcmp(mime_type, "STRING") == 0 ||
+               strcmp(mime_type, "TEXT") == 0;
+}
+
+// Start copying the current (primary) selection into a snapshot
+void clipboard_snapshot_start(struct state *state, bool primary)
+{
+        struct wlr_data_source *data_source = primary ? NULL : state->seat->selection_source;
+        struct wlr_primary_selection_source *primary_source = primary ? state->seat->primary_selection_source : NULL;
+        struct clipboard_snapshot *snapshot;
+        struct clipboard_entry *entry;
+        struct wl_array *mime_types;
+        struct wl_signal *destroy_signal;
+        char **mime_type;
+        int fds[2], types = 0;
+
+        // The cache just took over, keep serving it
+        if ((data_source && data_source->impl == &cache_data_source_impl) ||
+            (primary_source && primary_source->impl == &cache_primary_source_impl))
+                return;
+
+        // Cleared because its client is gone, the snapshot is about to replace it
+        if (!data_source && !primary_source)
+                return;
+
+        clipboard_snapshot_drop(state, primary);
+        if (!state->clipboard.cache_limit)
+                return;
+
+        snapshot = clipboard_snapshot_create(state, primary);
+        if (!snapshot)
+                return;
+
+        mime_types = primary ? &primary_source->mime_types : &data_source->mime_types;
+        wl_array_for_each(mime_type, mime_types) {
+                if (types == CLIPBOARD_CACHE_TYPES)
+                        break;
+                if (!clipboard_mime_type_cacheable(*mime_type))
+                        continue;
+
+                entry = clipboard_entry_add(snapshot, *mime_type);
+                if (!entry)
+                        break;
+                if (clipboard_pipe(fds) < 0) {
+                        clipboard_entry_remove(snapshot, entry);
+                        break;
+                }
+                if (!clipboard_transfer_start(snapshot, entry, fds[0], true)) {
+                        clipboard_entry_remove(snapshot, entry);
+                        close(fds[1]);
+                        break;
+                }
+
+                // The source closes the write end once it's passed to the client
+                if (primary)
+                        wlr_primary_selection_source_send(primary_source, *mime_type, fds[1]);
+                else
+                        wlr_data_source_send(data_source, *mime_type, fds[1]);
+                ++types;
+        }
+
+        if (types == 0) {
+                clipboard_snapshot_unref(snapshot);
+                return;
+        }
+
+        snapshot->data_source = data_source;
+        snapshot->primary_source = primary_source;
+        destroy_signal = primary ? &primary_source->events.destroy : &data_source->events.destroy;
+        snapshot->listener_source_destroy.notify = handle_clipboard_source_destroy;
+        wl_signal_add(destroy_signal, &snapshot->listener_source_destroy);
+        state->clipboard.snapshots[primary] = snapshot;
+}
+
+void clipboard_finish(struct state *state)
+{
+        struct clipboard_transfer *transfer, *tmp;
+
+        if (state->clipboard.install_idle)
+                wl_event_source_remove(state->clipboard.install_idle);
+        clipboard_snapshot_drop(state, false);
+        clipboard_snapshot_drop(state, true);
+
+        // Pastes in progress
+        wl_list_for_each_safe(transfer, tmp, &state->clipboard.transfers, link)
+                clipboard_transfer_destroy(transfer);
+}
+
+void handle_request_set_selection(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_request_set_selection);
+        struct wlr_seat_request_set_selection_event *event = (struct wlr_seat_request_set_selection_event *)data;
+
+        wlr_log(WLR_INFO, "Request set selection");
+
+        // A client clearing the selection doesn't want it to live on in the cache
+        if (!event->source)
+                clipboard_snapshot_drop(state, false);
+        wlr_seat_set_selection(state->seat, event->source, event->serial);
+}
+
+void handle_request_set_primary_selection(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_request_set_primary_selection);
+        struct wlr_seat_request_set_primary_selection_event *event = (struct wlr_seat_request_set_primary_selection_event *)data;
+
+        if (!event->source)
+                clipboard_snapshot_drop(state, true);
+        wlr_seat_set_primary_selection(state->seat, event->source, event->serial);
+}
+
+void handle_set_selection(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_set_selection);
+
+        clipboard_snapshot_start(state, false);
+}
+
+void handle_set_primary_selection(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_set_primary_selection);
+
+        clipboard_snapshot_start(state, true);
+}
+
+void handle_request_start_drag(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_request_start_drag);
+        struct wlr_seat_request_start_drag_event *event = (struct wlr_seat_request_start_drag_event *)data;
+
+        // Only a client holding an implicit pointer grab (a pressed button) may start a drag
+        if (wlr_seat_validate_pointer_grab_serial(state->seat, event->origin, event->serial)) {
+                wlr_seat_start_pointer_drag(state->seat, event->drag, event->serial);
+                return;
+        }
+
+        wlr_log(WLR_DEBUG, "Ignoring drag without a pointer grab");
+        if (event->drag->source)
+                wlr_data_source_destroy(event->drag->source);
+}
+
+void handle_start_drag(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_start_drag);
+        struct wlr_drag *drag = (struct wlr_drag *)data;
+
+        // The icon's scene tree goes away with the icon
+        if (drag->icon)
+                wlr_scene_drag_icon_create(state->layer_drag_icon, drag->icon);
+        wlr_scene_node_set_position(&state->layer_drag_icon->node, (int)state->cursor->x, (int)state->cursor->y);
+}
+
+struct output_info *output_for_toplevel(struct toplevel_info *toplevel_info, struct wlr_output *requested)
+{
+        struct state *state = toplevel_info->state;
+        struct wlr_output *output = requested;
+        struct output_info *first;
+        struct wlr_box box;
+
+        // Prefer the output the client asked for, then the one the toplevel is on
+        if (!output) {
+                toplevel_get_bounds(toplevel_info, &box);
+                output = wlr_output_layout_output_at(state->output_layout,
+                                                     box.x + box.width / 2.0, box.y + box.height / 2.0);
+        }
+        if (!output)
+                output = wlr_output_layout_output_at(state->output_layout, state->cursor->x, state->cursor->y);
+        // Detached outputs are still listed, but have no place in the layout
+        if (output && output->data && ((struct output_info *)output->data)->scene_output)
+                return (struct output_info *)output->data;
+
+        wl_list_for_each(first, &state->outputs, link) {
+                if (first->scene_output)
+                        return first;
+        }
+        return NULL;
+}
+
+void toplevel_release_fullscreen(struct toplevel_info *toplevel_info)
+{
+        struct output_info *output_info = toplevel_info->fullscreen_output;
+
+        // Give the output back and put the toplevel where it was, without
+        // configuring it (it may not be mapped anymore)
+        if (!output_info)
+                return;
+
+        output_info->fullscreen_toplevels[toplevel_info->workspace->index] = NULL;
+        wlr_scene_node_destroy(&toplevel_info->fullscreen_background->node);
+        toplevel_info->fullscreen_background = NULL;
+        toplevel_info->fullscreen_output = NULL;
+
+        wlr_scene_node_reparent(&toplevel_info->scene_tree->node, toplevel_layer(toplevel_info));
+        toplevel_set_position(toplevel_info, toplevel_info->saved_geometry.x, toplevel_info->saved_geometry.y);
+
+        // Tiled toplevels go back to their place in the layout
+        if (toplevel_info->container)
+                layout_mark_dirty(toplevel_info->container);
+}
+
+void toplevel_set_fullscreen(struct toplevel_info *toplevel_info, bool fullscreen, struct wlr_output *output)
+{
+        static const float black[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+        struct state *state = toplevel_info->state;
+        struct output_info *output_info = toplevel_info->fullscreen_output;
+        struct wlr_box geometry, output_box;
+
+        // The layout no longer decides where the toplevel goes
+        transaction_remove(toplevel_info);
+
+        if (!fullscreen) {
+                if (!output_info)
+                        return;
+
+                toplevel_release_fullscreen(toplevel_info);
+                wlr_xdg_toplevel_set_size(toplevel_info->xdg_toplevel, toplevel_info->saved_geometry.width,
+                                          toplevel_info->saved_geometry.height);
+                wlr_xdg_toplevel_set_fullscreen(toplevel_info->xdg_toplevel, false);
+                return;
+        }
+
+        // Moving a fullscreen toplevel to another output
+        toplevel_release_fullscreen(toplevel_info);
+
+        output_info = output_for_toplevel(toplevel_info, output);
+        if (!output_info) {
+                // Nowhere to go fullscreen, but the client still needs a configure
+                wlr_xdg_surface_schedule_configure(toplevel_info->xdg_toplevel->base);
+                return;
+        }
+
+        // Only one fullscreen toplevel per output and workspace
+        if (output_info->fullscreen_toplevels[toplevel_info->workspace->index])
+                toplevel_set_fullscreen(output_info->fullscreen_toplevels[toplevel_info->workspace->index], false, NULL);
+
+        wlr_xdg_surface_get_geometry(toplevel_info->xdg_toplevel->base, &geometry);
+        toplevel_info->saved_geometry.x = toplevel_info->scene_tree->node.x;
+        toplevel_info->saved_geometry.y = toplevel_info->scene_tree->node.y;
+        toplevel_info->saved_geometry.width = geometry.width;
+        toplevel_info->saved_geometry.height = geometry.height;
+
+        // Put the toplevel alone on top of its output, over an opaque background.
+        // When the client's buffer is opaque and covers the output, everything below
+        // is occluded and the scene can hand the buffer straight to the display.
+        wlr_output_layout_get_box(state->output_layout, output_info->output, &output_box);
+        toplevel_info->fullscreen_background = wlr_scene_rect_create(toplevel_info->workspace->layer_fullscreen,
+                                                                     output_box.width, output_box.height, black);
+        wlr_scene_node_set_position(&toplevel_info->fullscreen_background->node, output_box.x, output_box.y);
+        wlr_scene_node_reparent(&toplevel_info->scene_tree->node, toplevel_info->workspace->layer_fullscreen);
+
+        output_info->fullscreen_toplevels[toplevel_info->workspace->index] = toplevel_info;
+        toplevel_info->fullscreen_output = output_info;
+        toplevel_set_position(toplevel_info, output_box.x - geometry.x, output_box.y - geometry.y);
+        wlr_xdg_toplevel_set_size(toplevel_info->xdg_toplevel, output_box.width, output_box.height);
+        wlr_xdg_toplevel_set_fullscreen(toplevel_info->xdg_toplevel, true);
+
+        if (toplevel_info->xdg_toplevel->base->surface->mapped)
+                focus_toplevel(toplevel_info);
+}
+
+// Fit the fullscreen toplevels (and their backgrounds) to the output again
+// after its mode, scale, transform or position changed
+void output_update_fullscreen(struct output_info *output_info)
+{
+        struct toplevel_info *toplevel_info;
+        struct wlr_box geometry, output_box;
+        int i;
+
+        wlr_output_layout_get_box(output_info->state->output_layout, output_info->output, &output_box);
+        if (wlr_box_empty(&output_box))
+                return;
+
+        for (i = 0; i < WORKSPACE_COUNT; ++i) {
+                toplevel_info = output_info->fullscreen_toplevels[i];
+                if (!toplevel_info)
+                        continue;
+
+                wlr_scene_rect_set_size(toplevel_info->fullscreen_background, output_box.width, output_box.height);
+                wlr_scene_node_set_position(&toplevel_info->fullscreen_background->node, output_box.x, output_box.y);
+
+                wlr_xdg_surface_get_geometry(toplevel_info->xdg_toplevel->base, &geometry);
+                toplevel_set_position(toplevel_info, output_box.x - geometry.x, output_box.y - geometry.y);
+                wlr_xdg_toplevel_set_size(toplevel_info->xdg_toplevel, output_box.width, output_box.height);
+        }
+}
+
+void handle_xdg_toplevel_request_fullscreen(struct wl_listener *listener, void *data)
+{
+        struct toplevel_info *toplevel_info = wl_container_of(listener, toplevel_info, listener_request_fullscreen);
+        struct wlr_xdg_toplevel *xdg_toplevel = toplevel_info->xdg_toplevel;
+
+        wlr_log(WLR_INFO, "XDG toplevel request fullscreen");
+
+        // Configures can't be sent before the initial commit, the request
+        // is handled there instead
+        if (!xdg_toplevel->base->initialized)
+                return;
+
+        toplevel_set_fullscreen(toplevel_info, xdg_toplevel->requested.fullscreen, xdg_toplevel->requested.fullscreen_output);
+}
+
+void handle_xdg_toplevel_map(struct wl_listener *listener, void *data)
+{
+	struct toplevel_info *toplevel_info = wl_container_of(listener, toplevel_info, listener_map);
+
+        wlr_log(WLR_INFO, "XDG toplevel map");
+
+        toplevel_info->mapped_before = true;
+
+        // The neighbours haven't made room yet, show up along with them
+        if (toplevel_info->transaction_waiting)
+                wlr_scene_node_set_enabled(&toplevel_info->scene_tree->node, false);
+
+        // Floating toplevels are placed once their size is known. Tiled ones
+        // are laid out again, now that their window geometry is known too.
+        if (toplevel_info->container && !toplevel_info->fullscreen_output) {
+                if (!toplevel_is_floating(toplevel_info))
+                        layout_mark_dirty(toplevel_info->container);
+                else if (!toplevel_info->placed)
+                        toplevel_place_floating(toplevel_info);
+        }
+
+        // Raise, activate and move keyboard focus to the new window. Toplevels
+        // coming back from the previous session don't take focus from the one
+        // that had it back then, they go below and last in the focus order.
+        if (!toplevel_info->session_restored || toplevel_info->session_focused || !toplevel_info->state->focused_toplevel) {
+                focus_toplevel(toplevel_info);
+        } else {
+                wlr_scene_node_lower_to_bottom(&toplevel_info->scene_tree->node);
+                toplevel_info->stacking = 0;
+                wl_list_remove(&toplevel_info->link);
+                wl_list_insert(toplevel_info->workspace->toplevels.prev, &toplevel_info->link);
+        }
+        toplevel_update_index(toplevel_info);
+
+        // No output renders it, so only the hidden frame timer paces it
+        if (toplevel_info->workspace != toplevel_info->state->workspace || !toplevel_info->container)
+                hidden_frame_timer_arm(toplevel_info->state);
+}
+
+void handle_xdg_toplevel_unmap(struct wl_listener *listener, void *data)
+{
+        struct toplevel_info *toplevel_info = wl_container_of(listener, toplevel_info, listener_unmap);
+
+        wlr_log(WLR_INFO, "XDG toplevel unmap");
+
+        spatial_index_remove(&toplevel_info->workspace->spatial_index, toplevel_info);
+
+        // Don't keep the output blacked out for a window that's gone
+        toplevel_release_fullscreen(toplevel_info);
+
+        // The other toplevels of its container can take the space
+        transaction_remove(toplevel_info);
+        layout_remove(toplevel_info);
+
+        // Give keyboard focus to the previously focused window
+        if (toplevel_info->state->focused_toplevel == toplevel_info) {
+                toplevel_info->state->focused_toplevel = NULL;
+                focus_next_mapped(toplevel_info->state, toplevel_info);
+        }
+}
+
+void handle_xdg_toplevel_commit(struct wl_listener *listener, void *data)
+{
+        struct toplevel_info *toplevel_info = wl_container_of(listener, toplevel_info, listener_commit);
+        struct bench *bench = toplevel_info->state->bench;
+        struct client_info *client_info;
+        struct output_info *output_info;
+        struct session_entry *entry;
+
+        TRACE(TRACE_TOPLEVEL_COMMIT, 0, 0);
+
+        if (bench && !bench->pending_commit_ns)
+                bench->pending_commit_ns = now_ns();
+
+        client_info = client_info_from_client(wl_resource_get_client(toplevel_info->xdg_toplevel->base->surface->resource));
+        if (client_info) {
+                rate_counter_add(&client_info->commits, (uint32_t)(now_ns() / 1000000));
+                latency_note_commit(client_info);
+        }
+
+        if (toplevel_info->in_transaction)
+                transaction_handle_commit(toplevel_info);
+
+	if (toplevel_info->xdg_toplevel->base->initial_commit) {
+		// The compostor has to reply with a configure when the xdg_surface does an initial commit
+		// so the client can map its surface. It's sent by the layout, so the toplevel
+		// gets its final size right away. Dialogs float. Toplevels from the
+                // previous session get their old place back.
+                output_info = output_at_cursor(toplevel_info->state);
+                // Only once per toplevel, a remap keeps the place it has now
+                entry = NULL;
+                if (!toplevel_info->session_restored && !toplevel_info->mapped_before)
+                        entry = session_match(toplevel_info->state, toplevel_info->xdg_toplevel);
+                if (entry)
+                        output_info = session_restore(toplevel_info, entry, output_info);
+                if (output_info && !toplevel_info->container) {
+                        if (toplevel_info->xdg_toplevel->parent && !toplevel_info->floating)
+                                toplevel_toggle_floating(toplevel_info);
+                        toplevel_info->configure_pending = true;
+                        layout_add(toplevel_info, output_info);
+                        if (entry && toplevel_is_floating(toplevel_info))
+                                session_restore_floating(toplevel_info, entry);
+                }
+
+                if (toplevel_info->xdg_toplevel->requested.fullscreen)
+                        toplevel_set_fullscreen(toplevel_info, true, toplevel_info->xdg_toplevel->requested.fullscreen_output);
+                else if (entry && (entry->flags & SESSION_FULLSCREEN))
+                        toplevel_set_fullscreen(toplevel_info, true, output_info ? output_info->output : NULL);
+                else if (!toplevel_info->container)
+		        wlr_xdg_toplevel_set_size(toplevel_info->xdg_toplevel, 0, 0);
+	}
+
+        // The surface (or its subsurfaces) may have been resized
+        if (toplevel_info->indexed)
+                toplevel_update_index(toplevel_info);
+
+}
+
+void toplevel_apply_client_policy(struct toplevel_info *toplevel_info)
+{
+        struct wlr_xdg_toplevel *xdg_toplevel = toplevel_info->xdg_toplevel;
+        struct client_info *client_info;
+        int commit_budget;
+
+        client_policy_resolve(toplevel_info->state, xdg_toplevel->app_id, &toplevel_info->allow_tearing, &commit_budget);
+
+        // The budget applies to the whole client, its latest toplevel decides
+        client_info = client_info_from_client(wl_resource_get_client(xdg_toplevel->resource));
+        if (client_info)
+                client_info->commit_budget = commit_budget;
+}
+
+void handle_xdg_toplevel_set_app_id(struct wl_listener *listener, void *data)
+{
+        struct toplevel_info *toplevel_info = wl_container_of(listener, toplevel_info, listener_set_app_id);
+
+        toplevel_apply_client_policy(toplevel_info);
+}
+
+void handle_xdg_toplevel_destroy(struct wl_listener *listener, void *data)
+{
+        struct toplevel_info *toplevel_info = (struct toplevel_info *)wl_container_of(listener, toplevel_info, listener_destroy);
+
+        wlr_log(WLR_INFO, "XDG toplevel destroy");
+
+        wl_list_remove(&toplevel_info->listener_map.link);
+	wl_list_remove(&toplevel_info->listener_unmap.link);
+	wl_list_remove(&toplevel_info->listener_commit.link);
+	wl_list_remove(&toplevel_info->listener_destroy.link);
+        wl_list_remove(&toplevel_info->listener_request_fullscreen.link);
+        wl_list_remove(&toplevel_info->listener_set_app_id.link);
+
+        // Unmapping already released the output, this only happens if the
+        // toplevel is destroyed while fullscreen but was never mapped
+        if (toplevel_info->fullscreen_output) {
+                toplevel_info->fullscreen_output->fullscreen_toplevels[toplevel_info->workspace->index] = NULL;
+                wlr_scene_node_destroy(&toplevel_info->fullscreen_background->node);
+                toplevel_info->fullscreen_background = NULL;
+        }
+
+        spatial_index_remove(&toplevel_info->workspace->spatial_index, toplevel_info);
+        transaction_remove(toplevel_info);
+        layout_remove(toplevel_info);
+        if (toplevel_info->state->focused_toplevel == toplevel_info)
+                toplevel_info->state->focused_toplevel = NULL;
+        wl_list_remove(&toplevel_info->link);
+        pool_free(&toplevel_info->state->pools.toplevels, toplevel_info);
+}
+
+void handle_xdg_new_toplevel(struct wl_listener *listener, void *data)
+{
+        struct state *state = (struct state *)wl_container_of(listener, state, listener_xdg_new_toplevel);
+        struct wlr_xdg_toplevel *xdg_toplevel = (struct wlr_xdg_toplevel *)data;
+        struct toplevel_info *toplevel_info;
+        
+        wlr_log(WLR_INFO, "XDG new toplevel");
+
+        toplevel_info = (struct toplevel_info *)pool_alloc(&state->pools.toplevels);
+        if (!toplevel_info) {
+                wl_resource_post_no_memory(xdg_toplevel->resource);
+                return;
+        }
+        toplevel_info->state = state;
+        toplevel_info->xdg_toplevel = xdg_toplevel;
+        toplevel_apply_client_policy(toplevel_info);
+
+        // New toplevels open on the shown workspace
+        toplevel_info->workspace = state->workspace;
+        toplevel_info->scene_tree = wlr_scene_xdg_surface_create(state->workspace->layer_normal, xdg_toplevel->base);
+        toplevel_info->scene_tree->node.data = toplevel_info;
+	xdg_toplevel->base->data = toplevel_info->scene_tree;
+
+        // Setup events
+        toplevel_info->listener_map.notify = handle_xdg_toplevel_map;
+        wl_signal_add(&xdg_toplevel->base->surface->events.map, &toplevel_info->listener_map);
+
+        toplevel_info->listener_unmap.notify = handle_xdg_toplevel_unmap;
+        wl_signal_add(&xdg_toplevel->base->surface->events.unmap, &toplevel_info->listener_unmap);
+
+        toplevel_info->listener_commit.notify = handle_xdg_toplevel_commit;
+        wl_signal_add(&xdg_toplevel->base->surface->events.commit, &toplevel_info->listener_commit);
+
+        toplevel_info->listener_destroy.notify = handle_xdg_toplevel_destroy;
+        wl_signal_add(&xdg_toplevel->events.destroy, &toplevel_info->listener_destroy);
+
+        toplevel_info->listener_request_fullscreen.notify = handle_xdg_toplevel_request_fullscreen;
+        wl_signal_add(&xdg_toplevel->events.request_fullscreen, &toplevel_info->listener_request_fullscreen);
+
+        toplevel_info->listener_set_app_id.notify = handle_xdg_toplevel_set_app_id;
+        wl_signal_add(&xdg_toplevel->events.set_app_id, &toplevel_info->listener_set_app_id);
+
+        wl_list_insert(&toplevel_info->workspace->toplevels, &toplevel_info->link);
+}
+
+uint32_t positioner_key_hash(const struct positioner_key *key)
+{
+        const unsigned char *bytes = (const unsigned char *)key;
+        uint32_t hash = 2166136261u; // FNV-1a
+        size_t i;
+
+        for (i = 0; i < sizeof(*key); ++i) {
+                hash ^= bytes[i];
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+// Place the popup inside the output its toplevel is on. The result only
+// depends on the positioner rules and the constraint box, so it's looked up
+// in the positioner cache first.
+void popup_unconstrain(struct popup_info *popup_info)
+{
+        struct state *state = popup_info->state;
+        struct wlr_xdg_popup *xdg_popup = popup_info->xdg_popup;
+        const struct wlr_xdg_positioner_rules *rules = &xdg_popup->scheduled.rules;
+        struct positioner_cache_entry *entry;
+        struct output_info *output_info;
+        struct positioner_key key;
+        struct wlr_box output_box;
+        int toplevel_sx, toplevel_sy;
+
+        output_info = output_for_toplevel(popup_info->toplevel_info, NULL);
+        if (!output_info) {
+                wlr_xdg_surface_schedule_configure(xdg_popup->base);
+                return;
+        }
+        wlr_output_layout_get_box(state->output_layout, output_info->output, &output_box);
+
+        // The output box relative to the parent of the popup
+        wlr_xdg_popup_get_toplevel_coords(xdg_popup, 0, 0, &toplevel_sx, &toplevel_sy);
+
+        memset(&key, 0, sizeof(key));
+        key.anchor_rect = rules->anchor_rect;
+        key.anchor = rules->anchor;
+        key.gravity = rules->gravity;
+        key.constraint_adjustment = rules->constraint_adjustment;
+        key.width = rules->size.width;
+        key.height = rules->size.height;
+        key.offset_x = rules->offset.x;
+        key.offset_y = rules->offset.y;
+        key.constraint.x = output_box.x - popup_info->toplevel_info->scene_tree->node.x - toplevel_sx;
+        key.constraint.y = output_box.y - popup_info->toplevel_info->scene_tree->node.y - toplevel_sy;
+        key.constraint.width = output_box.width;
+        key.constraint.height = output_box.height;
+
+        entry = &state->positioner_cache.entries[positioner_key_hash(&key) & (POSITIONER_CACHE_SIZE - 1)];
+        if (entry->valid && memcmp(&entry->key, &key, sizeof(key)) == 0) {
+                ++state->positioner_cache.hits;
+        } else {
+                ++state->positioner_cache.misses;
+                wlr_xdg_positioner_rules_get_geometry(rules, &entry->geometry);
+                wlr_xdg_positioner_rules_unconstrain_box(rules, &key.constraint, &entry->geometry);
+                entry->key = key;
+                entry->valid = true;
+        }
+
+        xdg_popup->scheduled.geometry = entry->geometry;
+        wlr_xdg_surface_schedule_configure(xdg_popup->base);
+}
+
+void handle_xdg_popup_commit(struct wl_listener *listener, void *data)
+{
+        struct popup_info *popup_info = wl_container_of(listener, popup_info, listener_commit);
+        struct client_info *client_info;
+
+        // Like toplevels, popups need a configure after their initial commit
+        if (popup_info->xdg_popup->base->initial_commit)
+                popup_unconstrain(popup_info);
+
+        // Menus are often what answers the input
+        if (popup_info->state->latency_tracking) {
+                client_info = client_info_from_client(wl_resource_get_client(popup_info->xdg_popup->resource));
+                if (client_info)
+                        latency_note_commit(client_info);
+        }
+
+        // Popups are part of the toplevel bounds for pointer focus
+        if (popup_info->toplevel_info->indexed)
+                toplevel_update_index(popup_info->toplevel_info);
+}
+
+void handle_xdg_popup_reposition(struct wl_listener *listener, void *data)
+{
+        struct popup_info *popup_info = wl_container_of(listener, popup_info, listener_reposition);
+
+        popup_unconstrain(popup_info);
+}
+
+void handle_xdg_popup_destroy(struct wl_listener *listener, void *data)
+{
+        struct popup_info *popup_info = wl_container_of(listener, popup_info, listener_destroy);
+
+        // The scene tree is destroyed along with the popup surface, and the
+        // toplevel bounds shrink again on its next commit
+        wl_list_remove(&popup_info->listener_commit.link);
+        wl_list_remove(&popup_info->listener_reposition.link);
+        wl_list_remove(&popup_info->listener_destroy.link);
+        pool_free(&popup_info->state->pools.popups, popup_info);
+}
+
+void handle_xdg_new_popup(struct wl_listener *listener, void *data)
+{
+        struct state *state = wl_container_of(listener, state, listener_xdg_new_popup);
+        struct wlr_xdg_popup *xdg_popup = (struct wlr_xdg_popup *)data;
+        struct wlr_xdg_surface *parent;
+        struct wlr_scene_tree *parent_tree;
+        struct popup_info *popup_info;
+
+        // Popups without a parent (allowed by the protocol, e.g. for layer
+        // shell surfaces) can't be placed, we only support xdg parents
+        parent = xdg_popup->parent ? wlr_xdg_surface_try_from_wlr_surface(xdg_popup->parent) : NULL;
+        if (!parent || !parent->data) {
+                wlr_log(WLR_ERROR, "Ignoring popup without a known parent");
+                return;
+        }
+        parent_tree = (struct wlr_scene_tree *)parent->data;
+
+        popup_info = (struct popup_info *)pool_alloc(&state->pools.popups);
+        if (!popup_info) {
+                wl_resource_post_no_memory(xdg_popup->resource);
+                return;
+        }
+
+        popup_info->state = state;
+        popup_info->xdg_popup = xdg_popup;
+
+        // Nested popups inherit the toplevel of their parent popup
+        if (parent->role == WLR_XDG_SURFACE_ROLE_POPUP)
+                popup_info->toplevel_info = ((struct popup_info *)parent_tree->node.data)->toplevel_info;
+        else
+                popup_info->toplevel_info = (struct toplevel_info *)parent_tree->node.data;
+
+        // The popup is stacked and moved along with its parent. Grabs (including
+        // dismissing the popup chain on outside clicks) are handled by the seat.
+        popup_info->scene_tree = wlr_scene_xdg_surface_create(parent_tree, xdg_popup->base);
+        popup_info->scene_tree->node.data = popup_info;
+        xdg_popup->base->data = popup_info->scene_tree;
+
+        popup_info->listener_commit.notify = handle_xdg_popup_commit;
+        wl_signal_add(&xdg_popup->base->surface->events.commit, &popup_info->listener_commit);
+        popup_info->listener_reposition.notify = handle_xdg_popup_reposition;
+        wl_signal_add(&xdg_popup->events.reposition, &popup_info->listener_reposition);
+        popup_info->listener_destroy.notify = handle_xdg_popup_destroy;
+        wl_signal_add(&xdg_popup->events.destroy, &popup_info->listener_destroy);
+}
+
+void bench_handle_present(struct wl_listener *listener, void *data)
+{
+        struct bench *bench = wl_container_of(listener, bench, listener_present);
+        struct wlr_output_event_present *event = (struct wlr_output_event_present *)data;
+        int64_t present_ns;
+
+        if (!bench->inflight_commit_ns)
+                return;
+
+        if (event->presented) {
+                present_ns = event->when ? timespec_to_ns(event->when) : now_ns();
+                bench_sample(&bench->present_latencies, present_ns - bench->inflight_commit_ns);
+        }
+
+        bench->inflight_commit_ns = 0;
+}
+
+int bench_handle_input_timer(void *data)
+{
+        struct bench *bench = (struct bench *)data;
+        int events = bench->input_rate >= 1000 ? bench->input_rate / 1000 : 1;
+        int interval_ms = bench->input_rate >= 1000 ? 1 : 1000 / bench->input_rate;
+        struct wlr_pointer_motion_event motion = { 0 };
+        struct wlr_keyboard_key_event key = { 0 };
+        int64_t start = now_ns();
+        int i;
+
+        // Move the pointer back and forth across the output
+        for (i = 0; i < events; ++i) {
+                motion.pointer = &bench->pointer;
+                motion.time_msec = (uint32_t)(start / 1000000);
+                motion.delta_x = (bench->input_events / 200) % 2 ? -4.0 : 4.0;
+                motion.delta_y = (bench->input_events / 100) % 2 ? -2.0 : 2.0;
+                motion.unaccel_dx = motion.delta_x;
+                motion.unaccel_dy = motion.delta_y;
+                wl_signal_emit_mutable(&bench->pointer.events.motion, &motion);
+                ++bench->input_events;
+        }
+        wl_signal_emit_mutable(&bench->pointer.events.frame, &bench->pointer);
+
+        // Type a key every 50 events, alternating press and release
+        if (bench->input_events % 50 < (uint64_t)events) {
+                key.time_msec = (uint32_t)(start / 1000000);
+                key.keycode = 30; // KEY_A
+                key.update_state = true;
+                key.state = bench->key_pressed ? WL_KEYBOARD_KEY_STATE_RELEASED : WL_KEYBOARD_KEY_STATE_PRESSED;
+                wlr_keyboard_notify_key(&bench->keyboard, &key);
+                bench->key_pressed = !bench->key_pressed;
+        }
+
+        bench_sample(&bench->input_times, now_ns() - start);
+
+        wl_event_source_timer_update(bench->input_timer, interval_ms);
+        return 0;
+}
+
+int compare_int64(const void *a, const void *b)
+{
+        int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+        return (x > y) - (x < y);
+}
+
+void bench_report_samples(const char *name, struct bench_samples *samples)
+{
+        if (samples->len == 0) {
+                printf("%-24s no samples\n", name);
+                return;
+        }
+
+        qsort(samples->values, samples->len, sizeof(*samples->values), compare_int64);
+        printf("%-24s n=%zu p50=%.1f p90=%.1f p99=%.1f max=%.1f (us)\n", name, samples->len,
+               samples->values[samples->len * 50 / 100] / 1000.0,
+               samples->values[samples->len * 90 / 100] / 1000.0,
+               samples->values[samples->len * 99 / 100] / 1000.0,
+               samples->values[samples->len - 1] / 1000.0);
+}
+
+double timeval_diff(const struct timeval *end, const struct timeval *start)
+{
+        return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+void bench_report(struct bench *bench)
+{
+        struct output_info *output_info;
+        struct rusage usage;
+        struct timespec end;
+        double elapsed, user, sys;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &usage);
+        elapsed = (timespec_to_ns(&end) - timespec_to_ns(&bench->start_time)) / 1e9;
+        user = timeval_diff(&usage.ru_utime, &bench->start_usage.ru_utime);
+        sys = timeval_diff(&usage.ru_stime, &bench->start_usage.ru_stime);
+
+        printf("bench: %d clients at %d Hz, input at %d Hz, %d outputs, %.1f s\n",
+               bench->clients, bench->commit_rate, bench->input_rate, bench->outputs, elapsed);
+        wl_list_for_each(output_info, &bench->state->outputs, link) {
+                printf("%-24s rendered=%lu skipped=%lu direct_scanout=%lu\n", output_info->output->name,
+                       (unsigned long)output_info->frames_rendered, (unsigned long)output_info->frames_skipped,
+                       (unsigned long)output_info->scanout_direct);
+                printf("%-24s avg=%.3f ms max=%.3f ms queue_wait avg=%.3f ms max=%.3f ms missed=%lu\n", "",
+                       output_info->frames_rendered ? output_info->frame_time_total_ns / 1e6 / output_info->frames_rendered : 0,
+                       output_info->frame_time_max_ns / 1e6,
+                       output_info->frames_rendered ? output_info->queue_wait_total_ns / 1e6 / output_info->frames_rendered : 0,
+                       output_info->queue_wait_max_ns / 1e6, (unsigned long)output_info->deadlines_missed);
+        }
+        bench_report_samples("frame time", &bench->frame_times);
+        bench_report_samples("commit-to-present", &bench->present_latencies);
+        bench_report_samples("input dispatch", &bench->input_times);
+        printf("%-24s events=%lu batches=%lu client_writes=%lu keyboard_switches=%lu (%.3f writes per event)\n",
+               "key delivery", (unsigned long)bench->state->input_queue.delivered,
+               (unsigned long)bench->state->input_queue.batches, (unsigned long)bench->state->input_queue.client_writes,
+               (unsigned long)bench->state->input_queue.keyboard_switches,
+               bench->state->input_queue.delivered ?
+                       (double)bench->state->input_queue.client_writes / bench->state->input_queue.delivered : 0);
+        if (bench->clipboard_copy && bench->clipboard_copy->end_ns && bench->clipboard_copy->size)
+                printf("%-24s %d MiB in %.1f ms (%.1f MiB/s), longest stall %.3f ms\n", "clipboard",
+                       bench->clipboard_mib, (bench->clipboard_copy->end_ns - bench->clipboard_copy->start_ns) / 1e6,
+                       bench->clipboard_mib / ((bench->clipboard_copy->end_ns - bench->clipboard_copy->start_ns) / 1e9),
+                       bench->state->clipboard.max_stall_ns / 1e6);
+        else if (bench->clipboard_copy)
+                printf("%-24s incomplete, %zu bytes copied\n", "clipboard", bench->clipboard_copy->size);
+        printf("%-24s user=%.2f s sys=%.2f s (%.1f%% of one core)\n", "cpu", user, sys,
+               elapsed > 0 ? (user + sys) / elapsed * 100 : 0);
+        printf("%-24s outputs=%zu/%zu keyboards=%zu/%zu toplevels=%zu/%zu (live/high water)\n", "pools",
+               bench->state->pools.outputs.live, bench->state->pools.outputs.high_water,
+               bench->state->pools.keyboards.live, bench->state->pools.keyboards.high_water,
+               bench->state->pools.toplevels.live, bench->state->pools.toplevels.high_water);
+        printf("%-24s %ld KiB\n", "max rss", usage.ru_maxrss);
+        fflush(stdout);
+}
+
+int bench_handle_end_timer(void *data)
+{
+        struct bench *bench = (struct bench *)data;
+
+        bench_report(bench);
+        wl_display_terminate(bench->state->display);
+
+        return 0;
+}
+
+bool bench_parse_options(struct bench *bench, char *options)
+{
+        char *const tokens[] = { "clients", "rate", "input", "duration", "client", "outputs", "clipboard", NULL };
+        char *value;
+
+        bench->clients = 4;
+        bench->commit_rate = 60;
+        bench->input_rate = 1000;
+        bench->duration = 10;
+        bench->outputs = 1;
+        bench->client_path = "./bench-client";
+
+        while (*options != '\0') {
+                switch (getsubopt(&options, tokens, &value)) {
+                case 0:
+                        bench->clients = value ? atoi(value) : 0;
+                        break;
+                case 1:
+                        bench->commit_rate = value ? atoi(value) : 0;
+                        break;
+                case 2:
+                        bench->input_rate = value ? atoi(value) : 0;
+                        break;
+                case 3:
+                        bench->duration = value ? atoi(value) : 0;
+                        break;
+                case 4:
+                        bench->client_path = value;
+                        break;
+                case 5:
+                        bench->outputs = value ? atoi(value) : 0;
+                        break;
+                case 6:
+                        bench->clipboard_mib = value ? atoi(value) : -1;
+                        break;
+                default:
+                        return false;
+                }
+        }
+
+        return bench->clients >= 0 && bench->commit_rate > 0 && bench->input_rate > 0 &&
+               bench->duration > 0 && bench->outputs > 0 && bench->clipboard_mib >= 0 && bench->client_path;
+}
+
+void bench_create_outputs(struct bench *bench)
+{
+        int i;
+
+        // The outputs are announced through the regular new_output path once the backend starts
+        bench->output = wlr_headless_add_output(bench->state->backend, 1920, 1080);
+        for (i = 1; i < bench->outputs; ++i)
+                wlr_headless_add_output(bench->state->backend, 1920, 1080);
+
+        bench->listener_present.notify = bench_handle_present;
+        wl_signal_add(&bench->output->events.present, &bench->listener_present);
+}
+
+// Copy a selection of the given size from one snapshot into another through a
+// pipe, both ends run on the event loop next to the clients and the input
+void bench_start_clipboard(struct bench *bench)
+{
+        struct state *state = bench->state;
+        size_t size = (size_t)bench->clipboard_mib * 1024 * 1024;
+        struct clipboard_entry *entry, *copy_entry;
+        int fds[2];
+
+        if (state->clipboard.cache_limit < size)
+                state->clipboard.cache_limit = size;
+
+        bench->clipboard_source = clipboard_snapshot_create(state, false);
+        bench->clipboard_copy = clipboard_snapshot_create(state, false);
+        if (!bench->clipboard_source || !bench->clipboard_copy)
+                return;
+
+        entry = clipboard_entry_add(bench->clipboard_source, "text/plain");
+        copy_entry = clipboard_entry_add(bench->clipboard_copy, "text/plain");
+        if (!entry || !copy_entry)
+                return;
+
+        entry->data = malloc(size);
+        if (!entry->data)
+                return;
+        memset(entry->data, 'x', size);
+        entry->len = entry->capacity = size;
+        entry->complete = true;
+        bench->clipboard_source->size = size;
+
+        if (clipboard_pipe(fds) < 0)
+                return;
+        bench->clipboard_copy->start_ns = now_ns();
+        if (clipboard_transfer_start(bench->clipboard_copy, copy_entry, fds[0], true))
+                clipboard_transfer_start(bench->clipboard_source, entry, fds[1], false);
+        else
+                close(fds[1]);
+}
+
+void bench_start(struct bench *bench)
+{
+        static const struct wlr_pointer_impl pointer_impl = { .name = "bench-pointer" };
+        static const struct wlr_keyboard_impl keyboard_impl = { .name = "bench-keyboard" };
+        struct state *state = bench->state;
+        char rate[16];
+        pid_t pid;
+        int i;
+
+        // Synthetic input devices go through the same setup as real ones
+        wlr_pointer_init(&bench->pointer, &pointer_impl, "bench-pointer");
+        input_device_add(state, &bench->pointer.base);
+        wlr_keyboard_init(&bench->keyboard, &keyboard_impl, "bench-keyboard");
+        input_device_add(state, &bench->keyboard.base);
+
+        // Spawn the synthetic clients, they inherit WAYLAND_DISPLAY
+        snprintf(rate, sizeof(rate), "%d", bench->commit_rate);
+        bench->client_pids = calloc(bench->clients, sizeof(*bench->client_pids));
+        for (i = 0; bench->client_pids && i < bench->clients; ++i) {
+                pid = fork();
+                if (pid == 0) {
+                        signal(SIGPIPE, SIG_DFL);
+                        execl(bench->client_path, bench->client_path, "-r", rate, (char *)NULL);
+                        _exit(127);
+                }
+                bench->client_pids[i] = pid;
+        }
 
-        // Use output's preferred mode (if it exists and the backend supports it)
-        output_mode = wlr_output_preferred_mode(output);
-        if (output_mode)
-                wlr_output_state_set_mode(&output_state, output_mode);
+        clock_gettime(CLOCK_MONOTONIC, &bench->start_time);
+        getrusage(RUSAGE_SELF, &bench->start_usage);
 
-        // Commit the output state
-        wlr_output_commit_state(output, &output_state);
-        wlr_output_state_finish(&output_state);
+        if (bench->clipboard_mib > 0)
+                bench_start_clipboard(bench);
 
-        // Allocate new custom state for this output
-        output_info = (struct output_info *)malloc(sizeof(*output_info));
-        output_info->state = state;
-        output_info->output = output;
+        bench->input_timer = wl_event_loop_add_timer(state->event_loop, bench_handle_input_timer, bench);
+        wl_event_source_timer_update(bench->input_timer, 1);
+        bench->end_timer = wl_event_loop_add_timer(state->event_loop, bench_handle_end_timer, bench);
+        wl_event_source_timer_update(bench->end_timer, bench->duration * 1000);
+}
 
-        // Setup listeners for new output
-        output_info->listener_frame.notify = handle_output_frame; // render frames
-        wl_signal_add(&output->events.frame, &output_info->listener_frame);
+void bench_finish(struct bench *bench)
+{
+        int i;
 
-        output_info->listener_request_state.notify = handle_output_request_state; // handles resolution change and other output state requests
-        wl_signal_add(&output->events.request_state, &output_info->listener_request_state);
+        if (bench->input_timer)
+                wl_event_source_remove(bench->input_timer);
+        if (bench->end_timer)
+                wl_event_source_remove(bench->end_timer);
 
-        output_info->listener_destroy.notify = handle_output_destroy;
-        wl_signal_add(&output->events.destroy, &output_info->listener_destroy);
+        for (i = 0; bench->client_pids && i < bench->clients; ++i) {
+                if (bench->client_pids[i] > 0) {
+                        kill(bench->client_pids[i], SIGTERM);
+                        waitpid(bench->client_pids[i], NULL, 0);
+                }
+        }
+        free(bench->client_pids);
 
-        // Link this output on the outputs linked list
-        wl_list_insert(&state->outputs, &output_info->link);
+        // Finishing the devices emits their destroy events, which cleans up the listeners
+        if (bench->input_timer) {
+                wlr_keyboard_finish(&bench->keyboard);
+                wlr_pointer_finish(&bench->pointer);
+        }
+        if (bench->output)
+                wl_list_remove(&bench->listener_present.link);
 
-        // Add this output to output layout
-        layout_output = wlr_output_layout_add_auto(state->output_layout, output);
+        // The transfers were cancelled by clipboard_finish
+        if (bench->clipboard_source)
+                clipboard_snapshot_unref(bench->clipboard_source);
+        if (bench->clipboard_copy)
+                clipboard_snapshot_unref(bench->clipboard_copy);
 
-        // Create wlr_scene_output to handle how the wlr_scene should be rendered on this output
-        scene_output = wlr_scene_output_create(state->scene, output);
-        wlr_scene_output_layout_add_output(state->scene_layout, layout_output, scene_output);
+        free(bench->frame_times.values);
+        free(bench->present_latencies.values);
+        free(bench->input_times.values);
 }
 
-
-void handle_cursor_motion(struct wl_listener *listener, void *data)
+// Metrics
+// Counters and histograms are served over a Unix socket. A client connects,
+// sends "text" (Prometheus text format) or "json" followed by a newline, and
+// gets a snapshot back before the connection is closed. Closing the write
+// side without a request also gets the text format.
+void metrics_write_string(FILE *file, const char *value, bool json)
 {
-        // This event triggers when we have a relative mouse motion (delta)
-        struct state *state = (struct state *)wl_container_of(listener, state, listener_cursor_motion);
-	struct wlr_pointer_motion_event *event = (struct wlr_pointer_motion_event *)data;
+        const unsigned char *c;
 
-        wlr_log(WLR_INFO, "Cursor motion");
+        for (c = (const unsigned char *)(value ? value : ""); *c; ++c) {
+                if (*c == '"' || *c == '\\')
+                        fprintf(file, "\\%c", *c);
+                else if (*c == '\n')
+                        fputs("\\n", file);
+                else if (*c >= 0x20)
+                        fputc(*c, file);
+                else if (json)
+                        fprintf(file, "\\u%04x", *c);
+                // Other control characters can't be escaped in label values, drop them
+        }
+}
 
-        wlr_cursor_set_xcursor(state->cursor, state->xcursor_manager, "default");
-        wlr_cursor_move(state->cursor, &event->pointer->base, event->delta_x, event->delta_y);
-        wlr_seat_pointer_clear_focus(state->seat);
+// Starts a sample line with a single label, the caller writes the value
+void metrics_text_sample(FILE *file, const char *metric, const char *label, const char *value)
+{
+        fprintf(file, "%s{%s=\"", metric, label);
+        metrics_write_string(file, value, false);
+        fputs("\"} ", file);
 }
 
-void handle_cursor_motion_absolute(struct wl_listener *listener, void *data)
+// Buckets are powers of two in microseconds (see histogram_add). The label is optional.
+void metrics_text_histogram(FILE *file, const char *metric, const char *label, const char *value,
+                            const struct histogram *histogram)
 {
-        // This event triggers when we have an absolute mouse motion, which
-        // can happen in things like running the compositor inside another
-        // Wayland compositor (which can set the mouse absolute position)
-        struct state *state = wl_container_of(listener, state, listener_cursor_motion_absolute);
-	struct wlr_pointer_motion_absolute_event *event = (struct wlr_pointer_motion_absolute_event *)data;
+        uint64_t cumulative = 0;
+        int i;
 
-        wlr_log(WLR_INFO, "Cursor absolute motion");
+        for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                cumulative += histogram->buckets[i];
+                fprintf(file, "%s_bucket{", metric);
+                if (label) {
+                        fprintf(file, "%s=\"", label);
+                        metrics_write_string(file, value, false);
+                        fputs("\",", file);
+                }
+                if (i < HISTOGRAM_BUCKETS - 1)
+                        fprintf(file, "le=\"%g\"} %lu\n", (double)(1 << i) / 1e6, (unsigned long)cumulative);
+                else
+                        fprintf(file, "le=\"+Inf\"} %lu\n", (unsigned long)cumulative);
+        }
 
-	wlr_cursor_set_xcursor(state->cursor, state->xcursor_manager, "default");
-	wlr_cursor_warp_absolute(state->cursor, &event->pointer->base, event->x, event->y);
-        wlr_seat_pointer_clear_focus(state->seat);
+        fprintf(file, "%s_sum", metric);
+        if (label) {
+                fprintf(file, "{%s=\"", label);
+                metrics_write_string(file, value, false);
+                fputs("\"}", file);
+        }
+        fprintf(file, " %.9f\n%s_count", histogram->sum_ns / 1e9, metric);
+        if (label) {
+                fprintf(file, "{%s=\"", label);
+                metrics_write_string(file, value, false);
+                fputs("\"}", file);
+        }
+        fprintf(file, " %lu\n", (unsigned long)histogram->count);
 }
 
-void handle_cursor_button(struct wl_listener *listener, void *data)
+void metrics_write_text(struct state *state, FILE *file)
 {
-        wlr_log(WLR_INFO, "Cursor button");
+        uint32_t now_msec = (uint32_t)(now_ns() / 1000000);
+        struct output_info *output_info;
+        struct device_info *device_info;
+        struct client_info *client_info;
+        char pid[16];
+
+        fprintf(file, "# TYPE compositor_clients gauge\ncompositor_clients %d\n", wl_list_length(&state->clients));
+        fprintf(file, "# TYPE compositor_toplevels gauge\ncompositor_toplevels %d\n", toplevel_count(state));
+        fprintf(file, "# TYPE compositor_workspace gauge\ncompositor_workspace %d\n", state->workspace->index + 1);
+        fprintf(file, "# TYPE compositor_workspace_switches_total counter\ncompositor_workspace_switches_total %lu\n",
+                (unsigned long)state->workspace_switches);
+        fprintf(file, "# TYPE compositor_session_restored_total counter\ncompositor_session_restored_total %lu\n",
+                (unsigned long)state->session.restored);
+
+        fputs("# TYPE compositor_output_frames_rendered_total counter\n", file);
+        wl_list_for_each(output_info, &state->outputs, link) {
+                metrics_text_sample(file, "compositor_output_frames_rendered_total", "output", output_info->output->name);
+                fprintf(file, "%lu\n", (unsigned long)output_info->frames_rendered);
+        }
+        fputs("# TYPE compositor_output_frames_skipped_total counter\n", file);
+        wl_list_for_each(output_info, &state->outputs, link) {
+                metrics_text_sample(file, "compositor_output_frames_skipped_total", "output", output_info->output->name);
+                fprintf(file, "%lu\n", (unsigned long)output_info->frames_skipped);
+        }
+        fputs("# TYPE compositor_output_deadlines_missed_total counter\n", file);
+        wl_list_for_each(output_info, &state->outputs, link) {
+                metrics_text_sample(file, "compositor_output_deadlines_missed_total", "output", output_info->output->name);
+                fprintf(file, "%lu\n", (unsigned long)output_info->deadlines_missed);
+        }
+
+        fputs("# TYPE compositor_output_frame_time_seconds histogram\n", file);
+        wl_list_for_each(output_info, &state->outputs, link)
+                metrics_text_histogram(file, "compositor_output_frame_time_seconds", "output", output_info->output->name,
+                                       &output_info->frame_times);
+
+        if (state->latency_tracking) {
+                fputs("# TYPE compositor_output_input_latency_seconds histogram\n", file);
+                wl_list_for_each(output_info, &state->outputs, link)
+                        metrics_text_histogram(file, "compositor_output_input_latency_seconds", "output",
+                                               output_info->output->name, &output_info->input_latencies);
+        }
+
+        fputs("# TYPE compositor_input_events_total counter\n", file);
+        wl_list_for_each(device_info, &state->devices, link) {
+                metrics_text_sample(file, "compositor_input_events_total", "device", device_info->device->name);
+                fprintf(file, "%lu\n", (unsigned long)device_info->events.total);
+        }
+        fputs("# TYPE compositor_input_events_per_second gauge\n", file);
+        wl_list_for_each(device_info, &state->devices, link) {
+                metrics_text_sample(file, "compositor_input_events_per_second", "device", device_info->device->name);
+                fprintf(file, "%lu\n", (unsigned long)rate_counter_get(&device_info->events, now_msec));
+        }
+
+        fputs("# TYPE compositor_client_commits_total counter\n", file);
+        wl_list_for_each(client_info, &state->clients, link) {
+                snprintf(pid, sizeof(pid), "%d", (int)client_info->pid);
+                metrics_text_sample(file, "compositor_client_commits_total", "pid", pid);
+                fprintf(file, "%lu\n", (unsigned long)client_info->commits.total);
+        }
+        fputs("# TYPE compositor_client_commits_per_second gauge\n", file);
+        wl_list_for_each(client_info, &state->clients, link) {
+                snprintf(pid, sizeof(pid), "%d", (int)client_info->pid);
+                metrics_text_sample(file, "compositor_client_commits_per_second", "pid", pid);
+                fprintf(file, "%lu\n", (unsigned long)rate_counter_get(&client_info->commits, now_msec));
+        }
+
+        fputs("# TYPE compositor_client_frames_withheld_total counter\n", file);
+        wl_list_for_each(client_info, &state->clients, link) {
+                snprintf(pid, sizeof(pid), "%d", (int)client_info->pid);
+                metrics_text_sample(file, "compositor_client_frames_withheld_total", "pid", pid);
+                fprintf(file, "%lu\n", (unsigned long)client_info->frames_withheld);
+        }
 
-        // TODO: Implement
+        if (state->latency_tracking) {
+                fputs("# TYPE compositor_client_input_to_commit_seconds histogram\n", file);
+                wl_list_for_each(client_info, &state->clients, link) {
+                        snprintf(pid, sizeof(pid), "%d", (int)client_info->pid);
+                        metrics_text_histogram(file, "compositor_client_input_to_commit_seconds", "pid", pid,
+                                               &client_info->latency.to_commit);
+                }
+                fputs("# TYPE compositor_client_input_latency_seconds histogram\n", file);
+                wl_list_for_each(client_info, &state->clients, link) {
+                        snprintf(pid, sizeof(pid), "%d", (int)client_info->pid);
+                        metrics_text_histogram(file, "compositor_client_input_latency_seconds", "pid", pid,
+                                               &client_info->latency.to_present);
+                }
+        }
+
+        fprintf(file, "# TYPE compositor_hidden_frames_done_total counter\ncompositor_hidden_frames_done_total %lu\n",
+                (unsigned long)state->hidden_frames_done);
+        fprintf(file, "# TYPE compositor_axis_events_total counter\ncompositor_axis_events_total %lu\n",
+                (unsigned long)state->axis_events);
+        fprintf(file, "# TYPE compositor_axis_events_sent_total counter\ncompositor_axis_events_sent_total %lu\n",
+                (unsigned long)state->axis_sent);
+
+        fprintf(file, "# TYPE compositor_layout_runs_total counter\ncompositor_layout_runs_total %lu\n",
+                (unsigned long)state->layout_runs);
+        fprintf(file, "# TYPE compositor_configures_sent_total counter\ncompositor_configures_sent_total %lu\n",
+                (unsigned long)state->configures_sent);
+        fprintf(file, "# TYPE compositor_configures_skipped_total counter\ncompositor_configures_skipped_total %lu\n",
+                (unsigned long)state->configures_skipped);
+        fprintf(file, "# TYPE compositor_transactions_total counter\ncompositor_transactions_total %lu\n",
+                (unsigned long)state->transaction.applied);
+        fprintf(file, "# TYPE compositor_transactions_timed_out_total counter\ncompositor_transactions_timed_out_total %lu\n",
+                (unsigned long)state->transaction.timed_out);
+        fputs("# TYPE compositor_transaction_time_seconds histogram\n", file);
+        metrics_text_histogram(file, "compositor_transaction_time_seconds", NULL, NULL, &state->transaction.times);
+        fprintf(file, "# TYPE compositor_clipboard_bytes_read_total counter\ncompositor_clipboard_bytes_read_total %lu\n",
+                (unsigned long)state->clipboard.bytes_read);
+        fprintf(file, "# TYPE compositor_clipboard_bytes_written_total counter\ncompositor_clipboard_bytes_written_total %lu\n",
+                (unsigned long)state->clipboard.bytes_written);
+        fprintf(file, "# TYPE compositor_clipboard_cache_pastes_total counter\ncompositor_clipboard_cache_pastes_total %lu\n",
+                (unsigned long)state->clipboard.pastes_served);
+        fprintf(file, "# TYPE compositor_clipboard_max_stall_seconds gauge\ncompositor_clipboard_max_stall_seconds %.9f\n",
+                state->clipboard.max_stall_ns / 1e9);
+        fprintf(file, "# TYPE compositor_positioner_cache_hits_total counter\ncompositor_positioner_cache_hits_total %lu\n",
+                (unsigned long)state->positioner_cache.hits);
+        fprintf(file, "# TYPE compositor_positioner_cache_misses_total counter\ncompositor_positioner_cache_misses_total %lu\n",
+                (unsigned long)state->positioner_cache.misses);
+
+        fputs("# TYPE compositor_pool_live_objects gauge\n", file);
+        metrics_text_sample(file, "compositor_pool_live_objects", "pool", "outputs");
+        fprintf(file, "%zu\n", state->pools.outputs.live);
+        metrics_text_sample(file, "compositor_pool_live_objects", "pool", "keyboards");
+        fprintf(file, "%zu\n", state->pools.keyboards.live);
+        metrics_text_sample(file, "compositor_pool_live_objects", "pool", "toplevels");
+        fprintf(file, "%zu\n", state->pools.toplevels.live);
+        fputs("# TYPE compositor_pool_high_water_objects gauge\n", file);
+        metrics_text_sample(file, "compositor_pool_high_water_objects", "pool", "outputs");
+        fprintf(file, "%zu\n", state->pools.outputs.high_water);
+        metrics_text_sample(file, "compositor_pool_high_water_objects", "pool", "keyboards");
+        fprintf(file, "%zu\n", state->pools.keyboards.high_water);
+        metrics_text_sample(file, "compositor_pool_high_water_objects", "pool", "toplevels");
+        fprintf(file, "%zu\n", state->pools.toplevels.high_water);
 }
 
-void handle_cursor_axis(struct wl_listener *listener, void *data)
+void metrics_json_histogram(FILE *file, const struct histogram *histogram)
 {
-        wlr_log(WLR_INFO, "Cursor axis");
+        int i;
 
-        // TODO: Implement
+        fprintf(file, "{\"count\":%lu,\"sum_ns\":%ld,\"buckets_us\":[", (unsigned long)histogram->count,
+                (long)histogram->sum_ns);
+        for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                fprintf(file, "%s%lu", i ? "," : "", (unsigned long)histogram->buckets[i]);
+        fputs("]}", file);
 }
 
-void handle_cursor_frame(struct wl_listener *listener, void *data)
+void metrics_write_json(struct state *state, FILE *file)
 {
-        struct state *state = wl_container_of(listener, state, listener_cursor_frame);
-        static bool is_first_frame = true;
+        uint32_t now_msec = (uint32_t)(now_ns() / 1000000);
+        struct output_info *output_info;
+        struct device_info *device_info;
+        struct client_info *client_info;
+        const char *separator;
+        int i;
 
-        wlr_log(WLR_INFO, "Cursor frame");
+        fprintf(file, "{\"toplevels\":%d,\"workspace\":%d,\"workspace_switches\":%lu,\"outputs\":[", toplevel_count(state),
+                state->workspace->index + 1, (unsigned long)state->workspace_switches);
+        separator = "";
+        wl_list_for_each(output_info, &state->outputs, link) {
+                fprintf(file, "%s{\"name\":\"", separator);
+                metrics_write_string(file, output_info->output->name, true);
+                fprintf(file, "\",\"frames_rendered\":%lu,\"frames_skipped\":%lu,\"deadlines_missed\":%lu,"
+                        "\"frame_time\":{\"count\":%lu,\"sum_ns\":%ld,\"max_ns\":%ld,\"buckets_us\":[",
+                        (unsigned long)output_info->frames_rendered, (unsigned long)output_info->frames_skipped,
+                        (unsigned long)output_info->deadlines_missed, (unsigned long)output_info->frame_times.count,
+                        (long)output_info->frame_times.sum_ns, (long)output_info->frame_time_max_ns);
+                for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+                        fprintf(file, "%s%lu", i ? "," : "", (unsigned long)output_info->frame_times.buckets[i]);
+                fputs("]}", file);
+                if (state->latency_tracking) {
+                        fputs(",\"input_latency\":", file);
+                        metrics_json_histogram(file, &output_info->input_latencies);
+                }
+                fputc('}', file);
+                separator = ",";
+        }
 
-        // Set default xcursor theme on first frame
-        // (without this it will only trigger on first mouse motion)
-        if (is_first_frame) {
-                wlr_cursor_set_xcursor(state->cursor, state->xcursor_manager, "default");
-                is_first_frame = false;
+        fputs("],\"devices\":[", file);
+        separator = "";
+        wl_list_for_each(device_info, &state->devices, link) {
+                fprintf(file, "%s{\"name\":\"", separator);
+                metrics_write_string(file, device_info->device->name, true);
+                fprintf(file, "\",\"events\":%lu,\"events_per_second\":%lu}", (unsigned long)device_info->events.total,
+                        (unsigned long)rate_counter_get(&device_info->events, now_msec));
+                separator = ",";
         }
 
-        // Notify focused client of the mouse frame event
-        wlr_seat_pointer_notify_frame(state->seat);
+        fputs("],\"clients\":[", file);
+        separator = "";
+        wl_list_for_each(client_info, &state->clients, link) {
+                fprintf(file, "%s{\"pid\":%d,\"commits\":%lu,\"commits_per_second\":%lu,\"commit_budget\":%d,"
+                        "\"frames_withheld\":%lu", separator,
+                        (int)client_info->pid, (unsigned long)client_info->commits.total,
+                        (unsigned long)rate_counter_get(&client_info->commits, now_msec),
+                        client_info->commit_budget, (unsigned long)client_info->frames_withheld);
+                if (state->latency_tracking) {
+                        fputs(",\"input_to_commit\":", file);
+                        metrics_json_histogram(file, &client_info->latency.to_commit);
+                        fputs(",\"input_latency\":", file);
+                        metrics_json_histogram(file, &client_info->latency.to_present);
+                }
+                fputc('}', file);
+                separator = ",";
+        }
+
+        fprintf(file, "],\"hidden_frames_done\":%lu", (unsigned long)state->hidden_frames_done);
+        fprintf(file, ",\"axis\":{\"events\":%lu,\"sent\":%lu}", (unsigned long)state->axis_events,
+                (unsigned long)state->axis_sent);
+        fprintf(file, ",\"layout\":{\"runs\":%lu,\"configures_sent\":%lu,\"configures_skipped\":%lu}",
+                (unsigned long)state->layout_runs, (unsigned long)state->configures_sent,
+                (unsigned long)state->configures_skipped);
+        fprintf(file, ",\"transactions\":{\"applied\":%lu,\"timed_out\":%lu,\"times\":",
+                (unsigned long)state->transaction.applied, (unsigned long)state->transaction.timed_out);
+        metrics_json_histogram(file, &state->transaction.times);
+        fputc('}', file);
+        fprintf(file, ",\"clipboard\":{\"bytes_read\":%lu,\"bytes_written\":%lu,\"cache_pastes\":%lu,\"max_stall_ns\":%ld}",
+                (unsigned long)state->clipboard.bytes_read, (unsigned long)state->clipboard.bytes_written,
+                (unsigned long)state->clipboard.pastes_served, (long)state->clipboard.max_stall_ns);
+        fprintf(file, ",\"positioner_cache\":{\"hits\":%lu,\"misses\":%lu}",
+                (unsigned long)state->positioner_cache.hits, (unsigned long)state->positioner_cache.misses);
+        fprintf(file, ",\"pools\":{\"outputs\":[%zu,%zu],\"keyboards\":[%zu,%zu],\"toplevels\":[%zu,%zu]}}\n",
+                state->pools.outputs.live, state->pools.outputs.high_water,
+                state->pools.keyboards.live, state->pools.keyboards.high_water,
+                state->pools.toplevels.live, state->pools.toplevels.high_water);
 }
 
-void handle_keyboard_modifiers(struct wl_listener *listener, void *data)
+void metrics_connection_destroy(struct metrics_connection *connection)
 {
-        wlr_log(WLR_INFO, "Keyboard modifiers");
+        wl_event_source_remove(connection->source);
+        close(connection->fd);
+        wl_list_remove(&connection->link);
+        --connection->state->metrics.connections_len;
+        free(connection->response);
+        free(connection);
+}
 
-        struct keyboard_info *keyboard_info = wl_container_of(listener, keyboard_info, listener_modifiers);
+bool metrics_connection_respond(struct metrics_connection *connection)
+{
+        char *request = connection->request;
+        FILE *file;
+
+        request[strcspn(request, "\r\n")] = '\0';
+
+        file = open_memstream(&connection->response, &connection->response_len);
+        if (!file)
+                return false;
+
+        if (*request == '\0' || strcmp(request, "text") == 0)
+                metrics_write_text(connection->state, file);
+        else if (strcmp(request, "json") == 0)
+                metrics_write_json(connection->state, file);
+        else
+                fprintf(file, "unknown request, use \"text\" or \"json\"\n");
 
-        // There is a limitation in the wayland protocol which only allows one keyboard per seat.
-        // But it doesn't matter that much because we can just set the current keyboard to the
-        // one that triggered an event and process it normally.
-        wlr_seat_set_keyboard(keyboard_info->state->seat, keyboard_info->keyboard);
-        wlr_seat_keyboard_notify_modifiers(keyboard_info->state->seat, &keyboard_info->keyboard->modifiers);
+        return fclose(file) == 0;
 }
 
-void handle_keyboard_key(struct wl_listener *listener, void *data)
+int handle_metrics_connection(int fd, uint32_t mask, void *data)
 {
-        wlr_log(WLR_INFO, "Keyboard key");
-
-        struct keyboard_info *keyboard_info = wl_container_of(listener, keyboard_info, listener_key);
-        struct state *state = keyboard_info->state;
-        struct wlr_keyboard_key_event *event = (struct wlr_keyboard_key_event *)data;
-        struct wlr_seat *seat = (struct wlr_seat *)state->seat;
-        uint32_t keycode;
-        const xkb_keysym_t *syms;
-        int nsyms;
-        uint32_t modifiers;
+        struct metrics_connection *connection = (struct metrics_connection *)data;
+        size_t space;
+        ssize_t len;
 
-        // Convert libinput keycode to xkbcommon keycode
-        keycode = event->keycode + 8;
-        nsyms = xkb_state_key_get_syms(keyboard_info->keyboard->xkb_state, keycode, &syms);
+        if (mask & WL_EVENT_ERROR) {
+                metrics_connection_destroy(connection);
+                return 0;
+        }
 
-        modifiers = wlr_keyboard_get_modifiers(keyboard_info->keyboard);
+        if (!connection->response) {
+                space = sizeof(connection->request) - 1 - connection->request_len;
+                len = read(fd, connection->request + connection->request_len, space);
+                if (len < 0) {
+                        if (errno != EAGAIN && errno != EINTR)
+                                metrics_connection_destroy(connection);
+                        return 0;
+                }
 
-        // TODO: Skip modifiers on key listener
-        if ((modifiers & WLR_MODIFIER_ALT) && event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
-                int i;
-                char buf[128];
+                connection->request_len += len;
+                connection->request[connection->request_len] = '\0';
 
-                xkb_state_key_get_utf8(keyboard_info->keyboard->xkb_state, keycode, buf, sizeof(buf));
-                wlr_log(WLR_INFO, "Handling key press internally (modifier was set): %s", buf);
+                // Wait for the rest of the request, unless it's complete, the
+                // client closed its side or the request is too long anyway
+                if (len > 0 && (size_t)len < space && !strchr(connection->request, '\n'))
+                        return 0;
 
-                for (i = 0; i < nsyms; ++i) {
-                        switch (syms[i]) {
-                        case XKB_KEY_q:
-                        case XKB_KEY_Q:
-                                wl_display_terminate(state->display);
-                                return;
-                        default:
-                                break;
-                        }
+                if (!metrics_connection_respond(connection)) {
+                        metrics_connection_destroy(connection);
+                        return 0;
                 }
+                wl_event_source_fd_update(connection->source, WL_EVENT_WRITABLE);
         }
 
-        // If we didn't handle the key event internally, we forward it to the client
-        wlr_seat_set_keyboard(seat, keyboard_info->keyboard);
-	wlr_seat_keyboard_notify_key(seat, event->time_msec, event->keycode, event->state);
-        wlr_log(WLR_INFO, "Key event forwarded to seat");
-}
+        // The scraper may be gone already, that must not raise SIGPIPE
+        len = send(fd, connection->response + connection->written, connection->response_len - connection->written, MSG_NOSIGNAL);
+        if (len < 0) {
+                if (errno != EAGAIN && errno != EINTR)
+                        metrics_connection_destroy(connection);
+                return 0;
+        }
 
-void handle_keyboard_destroy(struct wl_listener *listener, void *data)
-{
-        wlr_log(WLR_INFO, "Keyboard destroy");
+        connection->written += len;
+        if (connection->written == connection->response_len)
+                metrics_connection_destroy(connection);
 
-        struct keyboard_info *keyboard_info = wl_container_of(listener, keyboard_info, listener_destroy);
-	wl_list_remove(&keyboard_info->listener_modifiers.link);
-	wl_list_remove(&keyboard_info->listener_key.link);
-	wl_list_remove(&keyboard_info->listener_destroy.link);
-	wl_list_remove(&keyboard_info->link);
-	free(keyboard_info);
+        return 0;
 }
 
-void setup_new_keyboard(struct state *state, struct wlr_input_device *device)
+int handle_metrics_accept(int fd, uint32_t mask, void *data)
 {
-        struct wlr_keyboard *keyboard = wlr_keyboard_from_input_device(device);
-        struct keyboard_info *keyboard_info = malloc(sizeof(*keyboard_info));
-        struct xkb_context *xkb_context;
-        struct xkb_keymap *xkb_keymap;
+        struct state *state = (struct state *)data;
+        struct metrics_connection *connection;
+        int connection_fd;
 
-        keyboard_info->state = state;
-        keyboard_info->keyboard = keyboard;
+        connection_fd = accept(fd, NULL, NULL);
+        if (connection_fd < 0)
+                return 0;
 
-        // Setup XKB keymap for this keyboard with its defaults
-        // (e.g US layout)
-        xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-        xkb_keymap = xkb_keymap_new_from_names(xkb_context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
-        wlr_keyboard_set_keymap(keyboard, xkb_keymap);
-        wlr_keyboard_set_repeat_info(keyboard, 50, 300); // Key repeat frequency and delay
+        // A scraper that never sends its request must not stall the compositor
+        if (state->metrics.connections_len >= METRICS_MAX_CONNECTIONS ||
+            fcntl(connection_fd, F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(connection_fd, F_SETFD, FD_CLOEXEC) < 0) {
+                close(connection_fd);
+                return 0;
+        }
 
-        // Setup keyboard event listeners
-        keyboard_info->listener_modifiers.notify = handle_keyboard_modifiers;
-        wl_signal_add(&keyboard->events.modifiers, &keyboard_info->listener_modifiers);
-        keyboard_info->listener_key.notify = handle_keyboard_key;
-        wl_signal_add(&keyboard->events.key, &keyboard_info->listener_key);
-        keyboard_info->listener_destroy.notify = handle_keyboard_destroy;
-        wl_signal_add(&device->events.destroy, &keyboard_info->listener_destroy);
+        connection = calloc(1, sizeof(*connection));
+        if (!connection) {
+                close(connection_fd);
+                return 0;
+        }
 
-        // Finish keyboard setup
-        wlr_seat_set_keyboard(state->seat, keyboard_info->keyboard);
-        wl_list_insert(&state->keyboards, &keyboard_info->link);
+        connection->state = state;
+        connection->fd = connection_fd;
+        connection->source = wl_event_loop_add_fd(state->event_loop, connection_fd, WL_EVENT_READABLE,
+                                                  handle_metrics_connection, connection);
+        if (!connection->source) {
+                close(connection_fd);
+                free(connection);
+                return 0;
+        }
+
+        wl_list_insert(&state->metrics.connections, &connection->link);
+        ++state->metrics.connections_len;
+
+        return 0;
 }
 
-void handle_new_input(struct wl_listener *listener, void *data)
+bool metrics_init(struct state *state, const char *path)
 {
-        struct state *state = wl_container_of(listener, state, listener_new_input);
-        struct wlr_input_device *device = (struct wlr_input_device *)data;
-                
-        wlr_log(WLR_INFO, "New input");
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
 
-        switch (device->type) {
-        case WLR_INPUT_DEVICE_KEYBOARD:
-                setup_new_keyboard(state, device);
-                break;
-        case WLR_INPUT_DEVICE_POINTER:
-                wlr_cursor_attach_input_device(state->cursor, device);
-                break;
-        default:
-                break;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                wlr_log(WLR_ERROR, "Metrics socket path '%s' is too long", path);
+                return false;
+        }
+        strcpy(addr.sun_path, path);
+
+        state->metrics.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (state->metrics.fd < 0) {
+                wlr_log_errno(WLR_ERROR, "Failed to create metrics socket");
+                return false;
         }
+
+        // A previous instance that crashed may have left its socket behind
+        unlink(path);
+        if (bind(state->metrics.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(state->metrics.fd, METRICS_MAX_CONNECTIONS) < 0) {
+                wlr_log_errno(WLR_ERROR, "Failed to listen on metrics socket '%s'", path);
+                close(state->metrics.fd);
+                state->metrics.fd = -1;
+                return false;
+        }
+
+        state->metrics.path = strdup(path);
+        state->metrics.source = wl_event_loop_add_fd(state->event_loop, state->metrics.fd, WL_EVENT_READABLE,
+                                                     handle_metrics_accept, state);
+        wlr_log(WLR_INFO, "Metrics socket: %s", path);
+
+        return true;
 }
 
-void handle_request_set_cursor(struct wl_listener *listener, void *data)
+void metrics_finish(struct state *state)
 {
-        struct state *state = wl_container_of(listener, state, listener_request_set_cursor);
-        struct wlr_seat_pointer_request_set_cursor_event *event = (struct wlr_seat_pointer_request_set_cursor_event *)data;
-        struct wlr_seat_client *focused_client = state->seat->pointer_state.focused_client;
+        struct metrics_connection *connection, *tmp;
 
-        wlr_log(WLR_INFO, "Request set cursor");
-
-        // Anyone can send this request, but we must only accept
-        // cursor changes by the seat client
-        if (focused_client != event->seat_client)
+        if (state->metrics.fd < 0)
                 return;
 
-        wlr_cursor_set_surface(state->cursor, event->surface, event->hotspot_x, event->hotspot_y);
+        wl_list_for_each_safe(connection, tmp, &state->metrics.connections, link)
+                metrics_connection_destroy(connection);
+
+        if (state->metrics.source)
+                wl_event_source_remove(state->metrics.source);
+        close(state->metrics.fd);
+        if (state->metrics.path)
+                unlink(state->metrics.path);
+        free(state->metrics.path);
 }
 
-void handle_request_set_selection(struct wl_listener *listener, void *data)
+// Startup
+// The time from main() to the first frame is what a restart costs, it's
+// logged per phase once the first frame is committed. Setup the first frame
+// doesn't need waits until then.
+void startup_mark(struct state *state, const char *name)
 {
-        wlr_log(WLR_INFO, "Request set selection");
+        if (state->startup.len == STARTUP_PHASES)
+                return;
 
-        // TODO: Implement
+        state->startup.phases[state->startup.len].name = name;
+        state->startup.phases[state->startup.len].ns = now_ns();
+        ++state->startup.len;
 }
 
-void handle_xdg_toplevel_map(struct wl_listener *listener, void *data)
+void handle_startup_idle(void *data)
 {
-	struct toplevel_info *toplevel_info = wl_container_of(listener, toplevel_info, listener_map);
-	struct state *state = toplevel_info->state;
-	struct wlr_seat *seat = state->seat;
-	struct wlr_keyboard *keyboard;
-
-        wlr_log(WLR_INFO, "XDG toplevel map");
+        struct state *state = (struct state *)data;
+        struct output_info *output_info;
+        int64_t start = now_ns();
 
-        wlr_scene_node_raise_to_top(&toplevel_info->scene_tree->node);
+        // Idle sources are removed after they run
+        state->startup.idle = NULL;
+        state->startup.deferred_done = true;
 
-	// Activate the toplevel surface
-	wlr_xdg_toplevel_set_activated(toplevel_info->xdg_toplevel, true);
+        cursor_theme_load(state, 1);
+        wl_list_for_each(output_info, &state->outputs, link)
+                cursor_theme_load(state, output_info->output->scale);
 
-	// Move keyboard focus to window
-	keyboard = wlr_seat_get_keyboard(seat);
-	if (keyboard != NULL) {
-		wlr_seat_keyboard_notify_enter(seat, toplevel_info->xdg_toplevel->base->surface,
-			keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
-	}
+        // A cursor image set before the theme was loaded may not have shown up
+        if (state->cursor_image.type == CURSOR_IMAGE_XCURSOR) {
+                wlr_cursor_unset_image(state->cursor);
+                wlr_cursor_set_xcursor(state->cursor, state->xcursor_manager, state->cursor_image.xcursor_name);
+        } else if (state->cursor_image.type == CURSOR_IMAGE_NONE) {
+                cursor_set_xcursor(state, "default");
+        }
 
-}
+        if (state->startup.metrics_path)
+                metrics_init(state, state->startup.metrics_path);
 
-void handle_xdg_toplevel_unmap(struct wl_listener *listener, void *data)
-{
-        wlr_log(WLR_INFO, "XDG toplevel unmap");
+        wlr_log(WLR_INFO, "Startup: deferred setup took %.3f ms", (now_ns() - start) / 1e6);
 }
 
-void handle_xdg_toplevel_commit(struct wl_listener *listener, void *data)
+void startup_defer(struct state *state)
 {
-        struct toplevel_info *toplevel_info = wl_container_of(listener, toplevel_info, listener_commit);
-
-        wlr_log(WLR_INFO, "XDG toplevel commit");
-
-	if (toplevel_info->xdg_toplevel->base->initial_commit) {
-		// The compostor has to reply with a configure when the xdg_surface does an initial commit
-		// so the client can map its surface
-		wlr_xdg_toplevel_set_size(toplevel_info->xdg_toplevel, 0, 0);
-	}
-
+        if (!state->startup.deferred_done && !state->startup.idle)
+                state->startup.idle = wl_event_loop_add_idle(state->event_loop, handle_startup_idle, state);
 }
 
-void handle_xdg_toplevel_destroy(struct wl_listener *listener, void *data)
+void startup_first_frame(struct state *state)
 {
-        struct toplevel_info *toplevel_info = (struct toplevel_info *)wl_container_of(listener, toplevel_info, listener_destroy);
+        int64_t previous = state->startup.start_ns;
+        int i;
 
-        wlr_log(WLR_INFO, "XDG toplevel destroy");
+        state->startup.first_frame = true;
+        startup_mark(state, "first frame");
 
-        wl_list_remove(&toplevel_info->listener_map.link);
-	wl_list_remove(&toplevel_info->listener_unmap.link);
-	wl_list_remove(&toplevel_info->listener_commit.link);
-	wl_list_remove(&toplevel_info->listener_destroy.link);
+        for (i = 0; i < state->startup.len; ++i) {
+                wlr_log(WLR_INFO, "Startup: %s after %.3f ms (+%.3f ms)", state->startup.phases[i].name,
+                        (state->startup.phases[i].ns - state->startup.start_ns) / 1e6,
+                        (state->startup.phases[i].ns - previous) / 1e6);
+                previous = state->startup.phases[i].ns;
+        }
 
-        wl_list_remove(&toplevel_info->link);
-        free(toplevel_info);
+        startup_defer(state);
 }
 
-void handle_xdg_new_toplevel(struct wl_listener *listener, void *data)
+void init_buffer_protocols(struct state *state)
 {
-        struct state *state = (struct state *)wl_container_of(listener, state, listener_xdg_new_toplevel);
-        struct wlr_xdg_toplevel *xdg_toplevel = (struct wlr_xdg_toplevel *)data;
-        struct toplevel_info *toplevel_info;
-        
-        wlr_log(WLR_INFO, "XDG new toplevel");
-
-        toplevel_info = (struct toplevel_info *)malloc(sizeof(*toplevel_info));
-        toplevel_info->state = state;
-        toplevel_info->xdg_toplevel = xdg_toplevel;
-        toplevel_info->scene_tree = wlr_scene_xdg_surface_create(&toplevel_info->state->scene->tree, xdg_toplevel->base);
-        toplevel_info->scene_tree->node.data = toplevel_info;
-	xdg_toplevel->base->data = toplevel_info->scene_tree;
+        int drm_fd;
 
-        // Setup events
-        toplevel_info->listener_map.notify = handle_xdg_toplevel_map;
-        wl_signal_add(&xdg_toplevel->base->surface->events.map, &toplevel_info->listener_map);
+        // Shared memory buffers work with every renderer, and are all we get on
+        // the headless backend with pixman
+        if (!wlr_renderer_init_wl_shm(state->renderer, state->display))
+                wlr_log(WLR_ERROR, "Failed to initialize shared memory buffers");
 
-        toplevel_info->listener_unmap.notify = handle_xdg_toplevel_unmap;
-        wl_signal_add(&xdg_toplevel->base->surface->events.unmap, &toplevel_info->listener_unmap);
+        // Only expose dmabufs when the renderer can import them without a copy
+        if (!wlr_renderer_get_texture_formats(state->renderer, WLR_BUFFER_CAP_DMABUF)) {
+                wlr_log(WLR_INFO, "Renderer can't import dmabufs, clients will use shared memory");
+                return;
+        }
 
-        toplevel_info->listener_commit.notify = handle_xdg_toplevel_commit;
-        wl_signal_add(&xdg_toplevel->base->surface->events.commit, &toplevel_info->listener_commit);
+        drm_fd = wlr_renderer_get_drm_fd(state->renderer);
+        if (drm_fd >= 0)
+                wlr_drm_create(state->display, state->renderer); // Legacy wl_drm, still used by older Mesa
 
-        toplevel_info->listener_destroy.notify = handle_xdg_toplevel_destroy;
-        wl_signal_add(&xdg_toplevel->events.destroy, &toplevel_info->listener_destroy);
+        state->linux_dmabuf = wlr_linux_dmabuf_v1_create_with_renderer(state->display, 4, state->renderer);
+        if (!state->linux_dmabuf) {
+                wlr_log(WLR_ERROR, "Failed to create linux-dmabuf global");
+                return;
+        }
 
-        wl_list_insert(&state->toplevels, &toplevel_info->link);
+        // Explicit sync lets clients pass acquire/release fences with their buffers
+        // instead of relying on implicit sync, which can stall on some drivers.
+        // Both the renderer and the backend have to support DRM timelines.
+        if (drm_fd >= 0 && state->renderer->features.timeline && state->backend->features.timeline) {
+                state->syncobj_manager = wlr_linux_drm_syncobj_manager_v1_create(state->display, 1, drm_fd);
+                if (!state->syncobj_manager)
+                        wlr_log(WLR_ERROR, "Failed to create linux-drm-syncobj global");
+        } else {
+                wlr_log(WLR_INFO, "Explicit sync not supported by the renderer or backend");
+        }
 }
 
-void handle_xdg_new_popup(struct wl_listener *listener, void *data)
+void usage(const char *name)
 {
-        wlr_log(WLR_INFO, "XDG new popup");
-
-        // TODO: Implement
+        fprintf(stderr,
+                "Usage: %s [options]\n"
+                "  -B OPTS  Run the headless benchmark, OPTS is a comma separated list of\n"
+                "           clients=N,rate=HZ,input=HZ,duration=SECONDS,outputs=N,clipboard=MIB,\n"
+                "           client=PATH\n"
+                "  -c FILE  Load the configuration (keybindings) from FILE\n"
+                "  -d       Delay rendering towards the next vblank to reduce latency\n"
+                "  -l       Measure the latency from input events to their presentation\n"
+                "           (reported per output and per client by the metrics socket)\n"
+                "  -M PATH  Serve metrics on the Unix socket PATH\n"
+                "           (default: $XDG_RUNTIME_DIR/<wayland socket>.metrics)\n"
+                "  -s FILE  Save the session (layout, workspaces, focus) to FILE on exit,\n"
+                "           and restore it from FILE on start. Windows are placed again when\n"
+                "           their clients are started within a minute, clients aren't\n"
+                "           relaunched (neither on start nor by the restart keybinding)\n"
+                "  -t FILE  Record trace events, dumped to FILE on SIGUSR1 and at exit\n"
+                "  -v       Enable debug logging\n"
+                "  -m       Coalesce pointer motion, processing it once per input frame\n"
+                "  -h       Show this help\n",
+                name);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
         struct state state = { 0 };
+        enum wlr_log_importance log_level = WLR_INFO;
+        struct wl_event_source *trace_signal = NULL;
+        struct bench bench = { 0 };
+        struct keymap_entry *keymap_entry, *keymap_tmp;
+        const char *config_path = NULL;
+        const char *metrics_path = NULL;
+        char default_metrics_path[256];
+        struct workspace *workspace;
+        int opt, i;
+
+        state.startup.start_ns = now_ns();
+
+        while ((opt = getopt(argc, argv, "B:c:dlM:ms:t:vh")) != -1) {
+                switch (opt) {
+                case 'B':
+                        if (!bench_parse_options(&bench, optarg)) {
+                                usage(argv[0]);
+                                return 1;
+                        }
+                        bench.state = &state;
+                        state.bench = &bench;
+                        break;
+                case 'c':
+                        config_path = optarg;
+                        break;
+                case 'd':
+                        state.frame_delay = true;
+                        break;
+                case 'l':
+                        state.latency_tracking = true;
+                        break;
+                case 'M':
+                        metrics_path = optarg;
+                        break;
+                case 'm':
+                        state.coalesce_motion = true;
+                        break;
+                case 's':
+                        state.session.path = optarg;
+                        break;
+                case 't':
+                        trace_ring.enabled = true;
+                        trace_ring.path = optarg;
+                        break;
+                case 'v':
+                        log_level = WLR_DEBUG;
+                        break;
+                case 'h':
+                        usage(argv[0]);
+                        return 0;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
 
         // Set up logger
-        wlr_log_init(WLR_INFO, NULL);
+        // NOTE: Per-event handlers don't log, use tracing (-t) to inspect them
+        wlr_log_init(log_level, NULL);
         wlr_log(WLR_INFO, "Initializing...");
 
+        // Clients can close their end of a clipboard pipe at any time, which
+        // must fail the write instead of killing the compositor
+        signal(SIGPIPE, SIG_IGN);
+
+        // Load the configuration (it only fills in the state, nothing is created yet)
+        pool_init(&state.pools.outputs, "outputs", sizeof(struct output_info));
+        pool_init(&state.pools.keyboards, "keyboards", sizeof(struct keyboard_info));
+        pool_init(&state.pools.toplevels, "toplevels", sizeof(struct toplevel_info));
+        pool_init(&state.pools.devices, "devices", sizeof(struct device_info));
+        pool_init(&state.pools.clients, "clients", sizeof(struct client_info));
+        pool_init(&state.pools.popups, "popups", sizeof(struct popup_info));
+        wl_list_init(&state.devices);
+        wl_list_init(&state.clients);
+        wl_list_init(&state.metrics.connections);
+        wl_list_init(&state.clipboard.transfers);
+        state.metrics.fd = -1;
+        state.hidden_frame_rate = 1;
+        state.default_layout = LAYOUT_TILING;
+        state.master_ratio = 0.5;
+        state.transaction.timeout_ms = TRANSACTION_TIMEOUT_MS;
+        wl_list_init(&state.transaction.toplevels);
+        wl_list_init(&state.output_policies);
+        wl_list_init(&state.client_policies);
+        keybindings_init_defaults(&state);
+        if (config_path && !config_load(&state, config_path))
+                wlr_log(WLR_ERROR, "Errors in config file '%s', some settings were ignored", config_path);
+        if (state.session.path)
+                session_load(&state);
+        startup_mark(&state, "config");
+
         // Create wayland display
         state.display = wl_display_create();
         state.event_loop = wl_display_get_event_loop(state.display);
 
+        // Track clients for the metrics
+        state.listener_client_created.notify = handle_client_created;
+        wl_display_add_client_created_listener(state.display, &state.listener_client_created);
+
+        // Allow dumping the trace ring buffer at any time
+        if (trace_ring.enabled)
+                trace_signal = wl_event_loop_add_signal(state.event_loop, SIGUSR1, handle_trace_signal, NULL);
+
         // Create wlroots backend (handles hardware IO), renderer (drawing) and
         // allocator (bridge for renderer to backend)
-        state.backend = wlr_backend_autocreate(state.event_loop, NULL);
-        state.renderer = wlr_renderer_autocreate(state.backend);
-	wlr_renderer_init_wl_display(state.renderer, state.display); // Initializes handler and shared memory buffer
+        // The benchmark always runs headless with the software renderer, so it
+        // behaves the same on machines without a GPU
+        if (state.bench) {
+                state.backend = wlr_headless_backend_create(state.event_loop);
+                state.renderer = wlr_pixman_renderer_create();
+        } else {
+                state.backend = wlr_backend_autocreate(state.event_loop, NULL);
+                state.renderer = wlr_renderer_autocreate(state.backend);
+        }
+        init_buffer_protocols(&state);
 
         state.allocator = wlr_allocator_autocreate(state.backend, state.renderer);
+        startup_mark(&state, "renderer");
 
         // Create compositor (allows clients to allocate surfaces) and
         // subcompositor (allows assigning roles of subsurfaces to surfaces)
         state.compositor = wlr_compositor_create(state.display, 5, state.renderer);
         state.subcompositor = wlr_subcompositor_create(state.display);
 
+        // Let clients hint that they prefer async page flips (tearing) over vsync,
+        // honoured for fullscreen clients when the output and client policies allow it
+        state.tearing_control = wlr_tearing_control_manager_v1_create(state.display, 1);
+
+        // Let clients know when their frames were actually presented
+        state.presentation = wlr_presentation_create(state.display, state.backend);
+
         // Create data device manager (handles clipboard)
         state.ddm = wlr_data_device_manager_create(state.display);
+        state.clipboard.primary_manager = wlr_primary_selection_v1_device_manager_create(state.display);
 
         // Create output layout (arranges screens in a physical layout)
         state.output_layout = wlr_output_layout_create(state.display);
+        state.listener_output_layout_change.notify = handle_output_layout_change;
+        wl_signal_add(&state.output_layout->events.change, &state.listener_output_layout_change);
+
+        // Output management (wlr-output-management), configurations are tested and
+        // applied for all outputs at once
+        state.output_manager = wlr_output_manager_v1_create(state.display);
+        state.listener_output_manager_apply.notify = handle_output_manager_apply;
+        wl_signal_add(&state.output_manager->events.apply, &state.listener_output_manager_apply);
+        state.listener_output_manager_test.notify = handle_output_manager_test;
+        wl_signal_add(&state.output_manager->events.test, &state.listener_output_manager_test);
 
         // Setup listener for new outputs
         // NOTE: This wl_list wont allocate anything, it will just set
         //       up the initial pointers which will point to valid data
         //       allocated elsewhere. We dont have to do cleanup.
         wl_list_init(&state.outputs);
+        wl_list_init(&state.render_queue);
+        state.budget_timer = wl_event_loop_add_timer(state.event_loop, handle_budget_timer, &state);
+        state.transaction.timer = wl_event_loop_add_timer(state.event_loop, handle_transaction_timer, &state);
+        if (state.hidden_frame_rate > 0)
+                state.hidden_frame_timer = wl_event_loop_add_timer(state.event_loop, handle_hidden_frame_timer, &state);
+        if (state.session.len) {
+                state.session.timer = wl_event_loop_add_timer(state.event_loop, handle_session_timer, &state);
+                wl_event_source_timer_update(state.session.timer, SESSION_GRACE_MS);
+        }
         state.listener_new_output.notify = handle_new_output;
         wl_signal_add(&state.backend->events.new_output, &state.listener_new_output);
 
@@ -538,6 +6490,31 @@ int main()
         state.scene = wlr_scene_create();
         state.scene_layout = wlr_scene_attach_output_layout(state.scene, state.output_layout);
 
+        // The scene sends the presentation feedback of the surfaces it shows
+        wlr_scene_set_presentation(state.scene, state.presentation);
+
+        // Let the scene send per-surface dmabuf feedback, which includes a scanout
+        // tranche for the output the surface is on (so clients can pick buffers
+        // that can go straight to a hardware plane)
+        if (state.linux_dmabuf)
+                wlr_scene_set_linux_dmabuf_v1(state.scene, state.linux_dmabuf);
+
+        // One subtree per workspace with its stacking layers, fullscreen toplevels
+        // always cover regular ones. Only the first workspace (or the one shown
+        // when the session was saved) is enabled.
+        for (i = 0; i < WORKSPACE_COUNT; ++i) {
+                workspace = &state.workspaces[i];
+                workspace->index = i;
+                workspace->tree = wlr_scene_tree_create(&state.scene->tree);
+                workspace->layer_normal = wlr_scene_tree_create(workspace->tree);
+                workspace->layer_floating = wlr_scene_tree_create(workspace->tree);
+                workspace->layer_fullscreen = wlr_scene_tree_create(workspace->tree);
+                wl_list_init(&workspace->toplevels);
+                wlr_scene_node_set_enabled(&workspace->tree->node, i == state.session.workspace);
+        }
+        state.workspace = &state.workspaces[state.session.workspace];
+        state.layer_drag_icon = wlr_scene_tree_create(&state.scene->tree);
+
         // Create a wlr_xdg_shell which handles roles for application windows
         state.xdg_shell = wlr_xdg_shell_create(state.display, 3);
 
@@ -547,10 +6524,10 @@ int main()
         wl_signal_add(&state.xdg_shell->events.new_toplevel, &state.listener_xdg_new_toplevel);
         state.listener_xdg_new_popup.notify = handle_xdg_new_popup;
         wl_signal_add(&state.xdg_shell->events.new_popup, &state.listener_xdg_new_popup);
-        wl_list_init(&state.toplevels);
 
         // Create a wlr_cursor to track the cursor and an xcursor manager
-        // to handle Xcursor themes and cursor scaling (HiDPI)
+        // to handle Xcursor themes and cursor scaling (HiDPI). The theme is
+        // loaded and the default cursor shown once the first frame is out.
         state.cursor = wlr_cursor_create();
         state.xcursor_manager = wlr_xcursor_manager_create(NULL, 24);
         wlr_cursor_attach_output_layout(state.cursor, state.output_layout);
@@ -573,15 +6550,31 @@ int main()
         state.listener_cursor_frame.notify = handle_cursor_frame;
         wl_signal_add(&state.cursor->events.frame, &state.listener_cursor_frame);
 
+        // Create a relative pointer manager (lets clients receive unaccelerated deltas)
+        state.relative_pointer_manager = wlr_relative_pointer_manager_v1_create(state.display);
+
         // Setup a seat (handle HID devices) and its listeners
         state.seat = wlr_seat_create(state.display, "seat0");
         wl_list_init(&state.keyboards);
+        wl_list_init(&state.keymaps);
+        state.xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
         state.listener_new_input.notify = handle_new_input;
         wl_signal_add(&state.backend->events.new_input, &state.listener_new_input);
         state.listener_request_set_cursor.notify = handle_request_set_cursor;
         wl_signal_add(&state.seat->events.request_set_cursor, &state.listener_request_set_cursor);
         state.listener_request_set_selection.notify = handle_request_set_selection;
         wl_signal_add(&state.seat->events.request_set_selection, &state.listener_request_set_selection);
+        state.listener_request_set_primary_selection.notify = handle_request_set_primary_selection;
+        wl_signal_add(&state.seat->events.request_set_primary_selection, &state.listener_request_set_primary_selection);
+        state.listener_set_selection.notify = handle_set_selection;
+        wl_signal_add(&state.seat->events.set_selection, &state.listener_set_selection);
+        state.listener_set_primary_selection.notify = handle_set_primary_selection;
+        wl_signal_add(&state.seat->events.set_primary_selection, &state.listener_set_primary_selection);
+        state.listener_request_start_drag.notify = handle_request_start_drag;
+        wl_signal_add(&state.seat->events.request_start_drag, &state.listener_request_start_drag);
+        state.listener_start_drag.notify = handle_start_drag;
+        wl_signal_add(&state.seat->events.start_drag, &state.listener_start_drag);
+        startup_mark(&state, "globals");
 
         // Create Unix socket to the Wayland display
         state.socket = (char *)wl_display_add_socket_auto(state.display);
@@ -592,17 +6585,76 @@ int main()
         setenv("WAYLAND_DISPLAY", state.socket, true);
         wlr_log(WLR_INFO, "Wayland socket: %s", state.socket);
 
+        // Serve metrics next to the Wayland socket, unless told otherwise
+        if (!metrics_path && getenv("XDG_RUNTIME_DIR")) {
+                snprintf(default_metrics_path, sizeof(default_metrics_path), "%s/%s.metrics",
+                         getenv("XDG_RUNTIME_DIR"), state.socket);
+                metrics_path = default_metrics_path;
+        }
+        state.startup.metrics_path = metrics_path;
+
+        if (state.bench)
+                bench_create_outputs(state.bench);
+
         if (!wlr_backend_start(state.backend)) {
                 wlr_log(WLR_ERROR, "Failed to start backend");
                 goto CLEAN_EXIT;
         }
+        startup_mark(&state, "backend start");
+
+        // Without outputs there's no first frame to wait for
+        if (wl_list_empty(&state.outputs))
+                startup_defer(&state);
+
+        if (state.bench)
+                bench_start(state.bench);
 
         // Run the Wayland event loop
         wlr_log(WLR_INFO, "Running event loop...");
         wl_display_run(state.display);
 
+        // Before the clients (and their toplevels) are gone
+        if (state.session.path)
+                session_save(&state);
+
         /******************** Clean up ********************/
 CLEAN_EXIT:
+        input_queue_flush(&state);
+        wlr_log(WLR_INFO, "Delivered %lu key events in %lu batches, %lu client writes (%lu keyboard switches)",
+                (unsigned long)state.input_queue.delivered, (unsigned long)state.input_queue.batches,
+                (unsigned long)state.input_queue.client_writes,
+                (unsigned long)state.input_queue.keyboard_switches);
+        cursor_image_reset(&state);
+        trace_dump();
+        if (trace_signal)
+                wl_event_source_remove(trace_signal);
+
+        // Toplevels get destroyed while the outputs and the layout still exist,
+        // instead of being moved around while the backend tears the outputs down
+        wl_display_destroy_clients(state.display);
+
+        if (state.startup.idle)
+                wl_event_source_remove(state.startup.idle);
+        if (state.render_idle)
+                wl_event_source_remove(state.render_idle);
+        if (state.layout_idle)
+                wl_event_source_remove(state.layout_idle);
+        if (state.hidden_frame_timer)
+                wl_event_source_remove(state.hidden_frame_timer);
+        if (state.budget_timer)
+                wl_event_source_remove(state.budget_timer);
+        if (state.session.timer)
+                wl_event_source_remove(state.session.timer);
+        if (state.transaction.timer) {
+                wl_event_source_remove(state.transaction.timer);
+                state.transaction.timer = NULL;
+        }
+        metrics_finish(&state);
+        clipboard_finish(&state);
+
+        if (state.bench)
+                bench_finish(state.bench);
+
         wlr_seat_destroy(state.seat);
         
         wlr_xcursor_manager_destroy(state.xcursor_manager);
@@ -610,8 +6662,12 @@ CLEAN_EXIT:
         
         // wlr_xdg_shell_destroy(state.xdg_shell);
         
+        wl_list_remove(&state.listener_output_layout_change.link);
         wlr_output_layout_destroy(state.output_layout);
 
+        for (i = 0; i < WORKSPACE_COUNT; ++i)
+                spatial_index_finish(&state.workspaces[i].spatial_index);
+
         // wlr_data_device_manager_destroy(state.ddm);
 
         // wlr_subcompositor_destroy(state.subcompositor);
@@ -621,7 +6677,33 @@ CLEAN_EXIT:
         wlr_renderer_destroy(state.renderer);
         wlr_backend_destroy(state.backend);
 
+        // The backend destroyed the remaining keyboards, so no keymap is in use anymore
+        wl_list_for_each_safe(keymap_entry, keymap_tmp, &state.keymaps, link)
+                keymap_entry_destroy(keymap_entry);
+        xkb_context_unref(state.xkb_context);
+
+        keybindings_finish(&state.keybindings);
+        policies_finish(&state);
+
         wl_display_destroy(state.display);
 
+        // Destroying the display destroyed the remaining toplevels
+        pool_finish(&state.pools.toplevels);
+        pool_finish(&state.pools.keyboards);
+        pool_finish(&state.pools.outputs);
+        pool_finish(&state.pools.devices);
+        pool_finish(&state.pools.clients);
+        pool_finish(&state.pools.popups);
+        session_finish(&state);
+
+        // Everything was torn down, the new instance starts from scratch but
+        // with the session that was just saved (and the same arguments)
+        if (state.restart) {
+                wlr_log(WLR_INFO, "Restarting...");
+                execv("/proc/self/exe", argv);
+                wlr_log_errno(WLR_ERROR, "Failed to restart");
+                return 1;
+        }
+
         return 0;
 }